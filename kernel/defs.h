@@ -2,12 +2,16 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
+struct spawnact;
+struct schedstat;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vmstat;
 
 // bio.c
 void            binit(void);
@@ -24,6 +28,7 @@ void            consputc(int);
 
 // exec.c
 int             kexec(char*, char**);
+int             loadimage(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -60,6 +65,41 @@ void            ireclaim(int);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kallocstat(struct vmstat*);
+void*           kalloc_zeroed(void);
+int             kalloc_batch(void**, int, int);
+int             kzerofill(void);
+
+// swap.c
+void            swapinit(int, struct superblock*);
+int             swapout(void);
+uint64          swapin(pagetable_t, uint64);
+void            swapinrange(pagetable_t, uint64, uint64);
+int             swapdup(pte_t*, pte_t);
+void            swapfree(pte_t);
+int             swapget(pagetable_t, uint64, char*);
+void            swapstat(struct vmstat*);
+void            swapref(uint64);
+
+// ksm.c
+void            ksminit(void);
+int             ksmctl(int);
+void            ksmtick(void);
+void            ksmdup(uint64);
+void            ksmput(uint64);
+int             ksmunshare(pte_t*, pte_t);
+void            ksmstat(struct vmstat*);
+
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+uint64          slabpages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -68,6 +108,7 @@ void            begin_op(void);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -82,8 +123,10 @@ void            printfinit(void);
 int             cpuid(void);
 void            kexit(int);
 int             kfork(void);
-int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             kspawn(char*, char**, struct spawnact*, int);
+int             growproc(int, int);
+int             kclone(uint64, uint64, uint64);
+int             kjoin(void);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kkill(int);
@@ -94,10 +137,17 @@ struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            setrunnable(struct proc*);
+int             schedtick(struct proc*, int);
+void            schedclock(void);
+int             ksetpriority(int, int);
+int             ksetaffinity(int, uint64);
+int             kschedstat(int, int, struct schedstat*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             kwait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -109,6 +159,11 @@ struct proc* findproc(int pid);
 int             proc_checkpoint(int, char *);
 int             proc_restore(char *);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, uint);
+int             futexwake(uint64, int);
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
@@ -145,6 +200,9 @@ void            syscall();
 
 // trap.c
 extern uint     ticks;
+extern uint64   quantum;
+extern int      tickless;
+void            ipi(int);
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -160,6 +218,10 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+void            asidinit(void);
+uint64          uvmswitch(struct proc*);
+void            uvmflush(struct proc*, uint64);
+void            uvmflushpt(pagetable_t, uint64);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
@@ -167,15 +229,22 @@ uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
-void            uvmclear(pagetable_t, uint64);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int *);
+int             uvmsplit(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 int             ismapped(pagetable_t, uint64);
 uint64          vmfault(pagetable_t, uint64, int);
+void            vmstat_get(struct vmstat*);
+int             uvmunshare(struct proc*);
+int             uvmadvise(struct proc*, uint64, uint64, int);
+void            wstick(void);
+void            wsself(void);
 int             vm_dump_memory(pagetable_t, uint64, struct inode*, uint*);
 int             vm_dump_proc_mem(struct proc*, int, struct inode*, uint*, uint64);
 int             vm_load_pagetable_from_inode(pagetable_t, struct inode*, uint*, uint64);
@@ -25,6 +25,23 @@ int flags2perm(int flags)
 //
 int
 kexec(char *path, char **argv)
+{
+  struct proc *p = myproc();
+
+  // the other threads are running in the old image.
+  if(p->leader->nthread > 1)
+    return -1;
+  return loadimage(p, path, argv);
+}
+
+// Replace p's user memory with the program at path, with
+// arguments argv, and set p's registers to start it. p is
+// the current process, or a new one that spawn() is building
+// and that isn't running yet. path is looked up relative to
+// the current process's directory.
+// Returns argc, or -1 on error, leaving p unchanged.
+int
+loadimage(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
@@ -33,7 +50,6 @@ kexec(char *path, char **argv)
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -78,7 +94,6 @@ kexec(char *path, char **argv)
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate some pages at the next page boundary.
@@ -89,7 +104,8 @@ kexec(char *path, char **argv)
   if((sz1 = uvmalloc(pagetable, sz, sz + (USERSTACK+1)*PGSIZE, PTE_W)) == 0)
     goto bad;
   sz = sz1;
-  uvmclear(pagetable, sz-(USERSTACK+1)*PGSIZE);
+  if(uvmclear(pagetable, sz-(USERSTACK+1)*PGSIZE) != 0)
+    goto bad;
   sp = sz;
   stackbase = sp - USERSTACK*PGSIZE;
 
@@ -130,6 +146,7 @@ kexec(char *path, char **argv)
   // Commit to the user image.
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->tlbflush = 1;    // the old image's TLB entries use the same ASID
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = ulib.c:start()
   p->trapframe->sp = sp; // initial stack pointer
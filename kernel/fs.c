@@ -45,6 +45,7 @@ fsinit(int dev) {
     panic("invalid file system");
   initlog(dev, &sb);
   ireclaim(dev);
+  swapinit(dev, &sb);
 }
 
 // Zero a block.
@@ -679,7 +680,7 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(myproc()->leader->cwd);
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
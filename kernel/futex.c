@@ -0,0 +1,106 @@
+// Futexes: blocking on a word of user memory.
+//
+// futex_wait(addr, val) sleeps if the word at addr still holds
+// val, and futex_wake(addr, n) wakes up to n processes sleeping
+// on that word. The user-space mutexes and condition variables
+// in user/ulib.c are built on them, and only call into the
+// kernel when they must block or wake someone.
+//
+// A futex is identified by the physical address of the word,
+// which is the channel its waiters sleep() on, so processes
+// that map the same page share it, and threads sharing a page
+// table do too. The page is made private and writable first:
+// a zero-page or merged (PTE_COW) page would be replaced by a
+// copy on the waker's first write, and the two would sleep and
+// wake on different words. A process sleeping in futex_wait()
+// is not pause()d or preempted, so neither the swapper nor ksm
+// moves the page while it waits; swappable() in swap.c and
+// ksmtick() in ksm.c must keep passing such processes by.
+//
+// The word is compared under a lock hashed from the key, which
+// futexwake() also takes, so a wakeup sent after the waker
+// changed the word can't be missed.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NFUTEXLOCK  16
+
+struct spinlock futexlocks[NFUTEXLOCK];
+
+#define FUTEXLOCK(key) (&futexlocks[((key) * 0x9E3779B97F4A7C15UL) >> 60])
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEXLOCK; i++)
+    initlock(&futexlocks[i], "futex");
+}
+
+// The physical address of the word at user address va in the
+// current process, after making its page private and writable.
+// Returns 0 if va is misaligned or not in the process.
+static uint64
+futexkey(uint64 va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  int level;
+  uint64 pa;
+
+  if(va % sizeof(uint) != 0 || va >= p->sz)
+    return 0;
+  pte = walklevel(p->pagetable, va, &level);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W)){
+    if(vmfault(p->pagetable, va, 0) == 0)
+      return 0;
+  }
+  if((pa = walkaddr(p->pagetable, va)) == 0)
+    return 0;
+  return pa + (va & (PGSIZE-1));
+}
+
+// Sleep on the futex at user address va if it holds val.
+// Returns 0 once woken, or -1 if va is bad, the word didn't
+// hold val, or the process was killed.
+int
+futexwait(uint64 va, uint val)
+{
+  struct spinlock *lk;
+  uint64 key;
+  int r = -1;
+
+  if((key = futexkey(va)) == 0)
+    return -1;
+  lk = FUTEXLOCK(key);
+  acquire(lk);
+  if(__atomic_load_n((uint*)key, __ATOMIC_SEQ_CST) == val && !killed(myproc())){
+    sleep((void*)key, lk);
+    r = killed(myproc()) ? -1 : 0;
+  }
+  release(lk);
+  return r;
+}
+
+// Wake up to n processes sleeping on the futex at user
+// address va. Returns the number woken, or -1 if va is bad.
+int
+futexwake(uint64 va, int n)
+{
+  struct spinlock *lk;
+  uint64 key;
+  int r;
+
+  if(n < 0 || (key = futexkey(va)) == 0)
+    return -1;
+  lk = FUTEXLOCK(key);
+  acquire(lk);
+  r = wakeupn((void*)key, n);
+  release(lk);
+  return r;
+}
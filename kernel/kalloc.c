@@ -1,6 +1,28 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// Memory is managed by a buddy allocator: free memory is
+// kept as blocks of 2^order pages, for order 0 (4 KB)
+// through KNORDER-1 (2 MB), each aligned to its own size.
+// kalloc_pages(order) splits a larger block if needed, and
+// kfree_pages() merges a block with its free buddy.
+//
+// Single pages, by far the most common request, are served
+// from per-CPU free lists, so that kalloc() and kfree()
+// normally touch only this CPU's list. Pages move between a
+// CPU's list and the buddy allocator KBATCH at a time; a CPU
+// whose list and the buddy allocator are both empty steals
+// half of another CPU's list. kalloc_batch() hands out many
+// pages for one acquisition of the CPU's list lock.
+//
+// Idle CPUs keep a pool of up to KZEROMAX pages that are
+// already zeroed, so that kalloc_zeroed(), used for lazy
+// faults and page tables, usually doesn't have to zero a
+// page itself.
+//
+// Building with KALLOC_DEBUG fills freed and newly
+// allocated pages with junk to catch dangling references.
 
 #include "types.h"
 #include "param.h"
@@ -8,6 +30,17 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "vm.h"
+#include "vmstat.h"
+
+#define KBATCH  32            // pages moved per refill or release
+#define KCPUMAX (4*KBATCH)    // release to the buddy allocator above this many
+#define KZEROMAX 256          // pre-zeroed pages kept for kalloc_zeroed()
+
+#define NPAGES  ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PGIDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+#define PG_FREE 0x80          // pginfo[]: first page of a free block
 
 void freerange(void *pa_start, void *pa_end);
 
@@ -16,50 +49,292 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;           // buddy free lists only
 };
 
+// buddy allocator.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run free[KNORDER];   // circular list heads, one per order
+  int nfree[KNORDER];         // blocks on each list
 } kmem;
 
+// for the first page of each free buddy block, PG_FREE|order;
+// zero for every other page.
+static uchar pginfo[NPAGES];
+
+// per-CPU lists of single pages. the lock is only
+// contended when another CPU steals from this list.
+struct kcpu {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  struct kcpustat stat;
+} kcpus[NCPU];
+
+// pages zeroed by idle CPUs. only the first word of
+// each page, the list link, is non-zero.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+  uint64 hit;                 // kalloc_zeroed() served from the pool
+  uint64 miss;                // kalloc_zeroed() had to zero a page
+} kzero;
+
+static void
+junk(void *pa, int c, uint64 n)
+{
+#ifdef KALLOC_DEBUG
+  memset(pa, c, n);
+#endif
+}
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int k = 0; k < KNORDER; k++)
+    kmem.free[k].next = kmem.free[k].prev = &kmem.free[k];
+  for(struct kcpu *kc = kcpus; kc < &kcpus[NCPU]; kc++)
+    initlock(&kc->lock, "kmem_cpu");
+  initlock(&kzero.lock, "kzero");
   freerange(end, (void*)PHYSTOP);
 }
 
+static void
+list_push(int order, struct run *r)
+{
+  struct run *h = &kmem.free[order];
+
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  kmem.nfree[order]++;
+  pginfo[PGIDX(r)] = PG_FREE | order;
+}
+
+static void
+list_remove(int order, struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nfree[order]--;
+  pginfo[PGIDX(r)] = 0;
+}
+
+// Return the block of 2^order pages at pa to the free lists,
+// merging it with its buddy for as long as the buddy is free.
+// Caller holds kmem.lock.
+static void
+buddy_free(uint64 pa, int order)
+{
+  uint64 bpa;
+
+  while(order < KNORDER-1){
+    bpa = KERNBASE + ((pa - KERNBASE) ^ ((uint64)PGSIZE << order));
+    if(pginfo[PGIDX(bpa)] != (PG_FREE | order))
+      break;
+    list_remove(order, (struct run*)bpa);
+    if(bpa < pa)
+      pa = bpa;
+    order++;
+  }
+  list_push(order, (struct run*)pa);
+}
+
+// Take a block of 2^order pages off the free lists, splitting
+// the smallest larger block if none of that order is free.
+// Returns 0 if no block is big enough.
+// Caller holds kmem.lock.
+static struct run *
+buddy_alloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k < KNORDER && kmem.nfree[k] == 0; k++)
+    ;
+  if(k == KNORDER)
+    return 0;
+  r = kmem.free[k].next;
+  list_remove(k, r);
+  while(k > order){
+    k--;
+    list_push(k, (struct run*)((char*)r + ((uint64)PGSIZE << k)));
+  }
+  return r;
+}
+
+// Hand [pa_start, pa_end) to the buddy allocator, in the
+// largest aligned blocks that fit.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 pa = PGROUNDUP((uint64)pa_start);
+  int k;
+
+  acquire(&kmem.lock);
+  while(pa + PGSIZE <= (uint64)pa_end){
+    for(k = KNORDER-1; k > 0; k--){
+      uint64 sz = (uint64)PGSIZE << k;
+      if(((pa - KERNBASE) & (sz - 1)) == 0 && pa + sz <= (uint64)pa_end)
+        break;
+    }
+    junk((void*)pa, 1, (uint64)PGSIZE << k);
+    buddy_free(pa, k);
+    pa += (uint64)PGSIZE << k;
+  }
+  release(&kmem.lock);
+}
+
+// Move up to KBATCH pages from the buddy allocator to kc.
+// Caller holds kc->lock.
+static void
+krefill(struct kcpu *kc)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  for(int i = 0; i < KBATCH && (r = buddy_alloc(0)) != 0; i++){
+    r->next = kc->freelist;
+    kc->freelist = r;
+    kc->nfree++;
+  }
+  release(&kmem.lock);
+  kc->stat.nrefill++;
+}
+
+// Take half of some other CPU's free list, keep all but
+// one page on kc's list, and return that one page.
+// Returns 0 if every list is empty.
+// Caller must not hold kc->lock, to avoid deadlock with
+// a CPU stealing in the other direction.
+static struct run *
+ksteal(struct kcpu *kc)
+{
+  struct run *r, *got = 0;
+  int n = 0;
+
+  for(struct kcpu *v = kcpus; v < &kcpus[NCPU] && got == 0; v++){
+    if(v == kc)
+      continue;
+    acquire(&v->lock);
+    for(n = (v->nfree + 1) / 2; n > 0; n--){
+      r = v->freelist;
+      v->freelist = r->next;
+      v->nfree--;
+      r->next = got;
+      got = r;
+    }
+    release(&v->lock);
+  }
+  if(got == 0)
+    return 0;
+
+  r = got;
+  got = got->next;
+  acquire(&kc->lock);
+  while(got){
+    struct run *next = got->next;
+    got->next = kc->freelist;
+    kc->freelist = got;
+    kc->nfree++;
+    got = next;
+  }
+  kc->stat.nsteal++;
+  kc->stat.nalloc++;
+  release(&kc->lock);
+  return r;
+}
+
+// Take a page from the pre-zeroed pool, or return 0.
+static struct run *
+kzero_take(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.list) != 0){
+    kzero.list = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  if(r)
+    r->next = 0;
+  return r;
+}
+
+// Give every CPU's cached single pages, and the pre-zeroed
+// pool, back to the buddy allocator, so that they can merge
+// into larger blocks.
+static void
+kdrain(void)
+{
+  struct run *r;
+
+  while((r = kzero_take()) != 0){
+    acquire(&kmem.lock);
+    buddy_free((uint64)r, 0);
+    release(&kmem.lock);
+  }
+
+  for(struct kcpu *kc = kcpus; kc < &kcpus[NCPU]; kc++){
+    acquire(&kc->lock);
+    acquire(&kmem.lock);
+    while((r = kc->freelist) != 0){
+      kc->freelist = r->next;
+      buddy_free((uint64)r, 0);
+    }
+    kc->nfree = 0;
+    release(&kmem.lock);
+    release(&kc->lock);
+  }
 }
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *batch;
+  struct kcpu *kc;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  junk(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kcpus[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  kc->stat.nfree++;
+  if(kc->nfree > KCPUMAX){
+    // give a batch back to the buddy allocator.
+    batch = kc->freelist;
+    r = batch;
+    for(int i = 1; i < KBATCH; i++)
+      r = r->next;
+    kc->freelist = r->next;
+    kc->nfree -= KBATCH;
+    acquire(&kmem.lock);
+    for(int i = 0; i < KBATCH; i++){
+      r = batch;
+      batch = batch->next;
+      buddy_free((uint64)r, 0);
+    }
+    release(&kmem.lock);
+  }
+  release(&kc->lock);
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +344,198 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kcpu *kc;
+
+  push_off();
+  kc = &kcpus[cpuid()];
+  acquire(&kc->lock);
+  if(kc->freelist == 0)
+    krefill(kc);
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->nfree--;
+    kc->stat.nalloc++;
+  }
+  release(&kc->lock);
+  if(r == 0)
+    r = ksteal(kc);
+  pop_off();
+  if(r == 0)
+    r = kzero_take();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
   if(r)
-    kmem.freelist = r->next;
+    junk((char*)r, 5, PGSIZE);
+  return (void*)r;
+}
+
+// Allocate one page of physical memory, filled with zeros.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = kzero_take()) != 0){
+    __sync_fetch_and_add(&kzero.hit, 1);
+    return (void*)r;
+  }
+  __sync_fetch_and_add(&kzero.miss, 1);
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Allocate up to n pages into pa[], taking this CPU's list
+// lock once rather than n times, and return how many were
+// allocated, which is fewer than n only if memory is short.
+// If zeroed is set, the pages are filled with zeros, and are
+// taken from the pre-zeroed pool first. Free them with kfree().
+int
+kalloc_batch(void **pa, int n, int zeroed)
+{
+  struct run *r;
+  struct kcpu *kc;
+  int got = 0, pooled;
+
+  if(zeroed){
+    acquire(&kzero.lock);
+    for(; got < n && (r = kzero.list) != 0; got++){
+      kzero.list = r->next;
+      kzero.n--;
+      r->next = 0;
+      pa[got] = r;
+    }
+    release(&kzero.lock);
+  }
+  pooled = got;
+
+  push_off();
+  kc = &kcpus[cpuid()];
+  acquire(&kc->lock);
+  while(got < n){
+    if(kc->freelist == 0){
+      krefill(kc);
+      if(kc->freelist == 0)
+        break;
+    }
+    r = kc->freelist;
+    kc->freelist = r->next;
+    kc->nfree--;
+    pa[got++] = r;
+  }
+  kc->stat.nalloc += got - pooled;
+  kc->stat.nbatch++;
+  release(&kc->lock);
+  pop_off();
+
+  for(int i = pooled; i < got; i++){
+    if(zeroed)
+      memset(pa[i], 0, PGSIZE);
+    else
+      junk(pa[i], 5, PGSIZE);
+  }
+  if(zeroed){
+    __sync_fetch_and_add(&kzero.hit, pooled);
+    __sync_fetch_and_add(&kzero.miss, got - pooled);
+  }
+  return got;
+}
+
+// Zero one free page and add it to the pool for
+// kalloc_zeroed(). Called by the scheduler on an idle CPU.
+// Returns 0 if the pool is full or memory is short.
+int
+kzerofill(void)
+{
+  struct run *r;
+
+  if(kzero.n >= KZEROMAX)
+    return 0;
+  acquire(&kmem.lock);
+  r = buddy_alloc(0);
+  release(&kmem.lock);
+  if(r == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kzero.lock);
+  r->next = kzero.list;
+  kzero.list = r;
+  kzero.n++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their total size. Returns 0 if out of memory.
+void *
+kalloc_pages(int order)
+{
+  struct run *r;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order >= KNORDER)
+    panic("kalloc_pages");
+
+  acquire(&kmem.lock);
+  r = buddy_alloc(order);
   release(&kmem.lock);
+  if(r == 0){
+    // pages cached on the per-CPU lists may complete a block.
+    kdrain();
+    acquire(&kmem.lock);
+    r = buddy_alloc(order);
+    release(&kmem.lock);
+  }
 
   if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+    junk((char*)r, 5, (uint64)PGSIZE << order);
   return (void*)r;
 }
+
+// Free 2^order pages at pa, as returned by kalloc_pages(order).
+// It's also fine to kfree() the pages of such a block one by one.
+void
+kfree_pages(void *pa, int order)
+{
+  uint64 sz = (uint64)PGSIZE << order;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order >= KNORDER || (((uint64)pa - KERNBASE) & (sz - 1)) != 0 ||
+     (char*)pa < end || (uint64)pa + sz > PHYSTOP)
+    panic("kfree_pages");
+
+  junk(pa, 1, sz);
+
+  acquire(&kmem.lock);
+  buddy_free((uint64)pa, order);
+  release(&kmem.lock);
+}
+
+// Fill in the allocator's part of the vmstat counters.
+// The numbers are read without locks, so they may be
+// slightly stale.
+void
+kallocstat(struct vmstat *st)
+{
+  uint64 nfree = 0;
+
+  for(int k = 0; k < KNORDER; k++){
+    st->freeblocks[k] = kmem.nfree[k];
+    nfree += (uint64)kmem.nfree[k] << k;
+  }
+  for(int i = 0; i < NCPU; i++){
+    nfree += kcpus[i].nfree;
+    st->cpu[i] = kcpus[i].stat;
+  }
+  nfree += kzero.n;
+  st->freepages = nfree;
+  st->prezeroed = kzero.n;
+  st->prezerohit = kzero.hit;
+  st->prezeromiss = kzero.miss;
+}
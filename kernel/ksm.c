@@ -0,0 +1,328 @@
+// Kernel same-page merging.
+//
+// When enabled with the ksm() system call, a scanner run from
+// clockintr() on CPU 0 walks the page tables of processes that
+// are preempted in user space or pause()d, at most KSMBUDGET
+// pages per tick, hashing their private writable pages.
+//
+// A page of zeros is replaced by the shared zero page. A page
+// whose contents match a page in the stable table is replaced
+// by a read-only mapping of that page, with PTE_COW set, and
+// freed. A page whose hash has already been seen during the
+// current pass over the processes, but isn't stable, becomes a
+// stable page itself, so that its twin merges with it on the
+// next pass.
+//
+// Stable pages are reference counted by the number of PTEs
+// that map them. A write fault on a PTE_COW page gives the
+// writer a private copy, or the page itself if it is the last
+// mapping; see vmfault(). fork shares them, and the swapper
+// leaves them alone.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "vm.h"
+#include "vmstat.h"
+
+#define KSMBUDGET   32      // pages hashed per tick
+#define KSMWALK     1024    // PTEs looked at per tick
+#define NKSMHASH    256     // stable-table hash buckets
+#define NSEEN       1024    // hashes remembered per pass
+
+extern struct vmstat vmstats;
+extern char *zeropage;
+
+struct ksmpage {
+  uint64 pa;
+  uint hash;                // of the contents
+  int ref;                  // PTEs that map the page
+  struct ksmpage *hnext;    // chain by hash
+  struct ksmpage *pnext;    // chain by pa
+};
+
+struct {
+  struct spinlock lock;     // protects the tables and counts
+  struct kmem_cache *cache;
+  struct ksmpage *byhash[NKSMHASH];
+  struct ksmpage *bypa[NKSMHASH];
+  int npages;               // stable pages
+  int nrefs;                // PTEs that map them
+
+  // scanner state, used only by ksmtick() on CPU 0.
+  int on;
+  struct proc *hand;        // next process to scan, or 0 to start a pass
+  uint64 handva;            // and next virtual address in it
+  uint seen[NSEEN];         // hashes seen this pass, with bit 0 set
+} ksm;
+
+#define PAHASH(pa)  (((pa) / PGSIZE) % NKSMHASH)
+
+void
+ksminit(void)
+{
+  initlock(&ksm.lock, "ksm");
+  ksm.cache = kmem_cache_create("ksmpage", sizeof(struct ksmpage));
+}
+
+// Turn the scanner on (on=1) or off (on=0); on<0 just queries.
+// Returns the previous setting.
+int
+ksmctl(int on)
+{
+  int old = ksm.on;
+
+  if(on >= 0)
+    ksm.on = on != 0;
+  return old;
+}
+
+static struct ksmpage*
+lookuppa(uint64 pa)
+{
+  struct ksmpage *k;
+
+  for(k = ksm.bypa[PAHASH(pa)]; k; k = k->pnext)
+    if(k->pa == pa)
+      return k;
+  return 0;
+}
+
+// Take k out of both tables and free it. Caller holds ksm.lock.
+static void
+ksmunlink(struct ksmpage *k)
+{
+  struct ksmpage **pp;
+
+  for(pp = &ksm.byhash[k->hash % NKSMHASH]; *pp != k; pp = &(*pp)->hnext)
+    ;
+  *pp = k->hnext;
+  for(pp = &ksm.bypa[PAHASH(k->pa)]; *pp != k; pp = &(*pp)->pnext)
+    ;
+  *pp = k->pnext;
+  ksm.npages--;
+  kmem_cache_free(ksm.cache, k);
+}
+
+// Another PTE now maps the stable page at pa.
+// Used by uvmcopy().
+void
+ksmdup(uint64 pa)
+{
+  struct ksmpage *k;
+
+  acquire(&ksm.lock);
+  if((k = lookuppa(pa)) == 0)
+    panic("ksmdup");
+  k->ref++;
+  ksm.nrefs++;
+  release(&ksm.lock);
+}
+
+// A PTE that mapped the stable page at pa is gone; free the
+// page if that was the last one.
+void
+ksmput(uint64 pa)
+{
+  struct ksmpage *k;
+  int free = 0;
+
+  acquire(&ksm.lock);
+  if((k = lookuppa(pa)) == 0)
+    panic("ksmput");
+  ksm.nrefs--;
+  if(--k->ref == 0){
+    ksmunlink(k);
+    free = 1;
+  }
+  release(&ksm.lock);
+  if(free)
+    kfree((void*)pa);
+}
+
+// If *pte, which was old when the caller read it and maps a
+// stable page, is the only PTE that maps the page, take it out
+// of the stable table, make *pte writable again, and return 1.
+// Return 0 if other PTEs map it too, or -1 if another thread
+// sharing the page table changed *pte meanwhile.
+int
+ksmunshare(pte_t *pte, pte_t old)
+{
+  struct ksmpage *k;
+  int r = 0;
+
+  acquire(&ksm.lock);
+  if(*pte != old){
+    release(&ksm.lock);
+    return -1;
+  }
+  if((k = lookuppa(PTE2PA(old))) == 0)
+    panic("ksmunshare");
+  if(k->ref == 1){
+    ksm.nrefs--;
+    ksmunlink(k);
+    *pte = (old & ~PTE_COW) | PTE_W;
+    r = 1;
+  }
+  release(&ksm.lock);
+  return r;
+}
+
+// Hash the page at pa. Sets *zero if it is all zeros.
+static uint
+pagehash(uint64 pa, int *zero)
+{
+  uint64 *w = (uint64*)pa;
+  uint64 h = 14695981039346656037UL, or = 0;
+
+  for(int i = 0; i < PGSIZE/sizeof(uint64); i++){
+    or |= w[i];
+    h = (h ^ w[i]) * 1099511628211UL;
+  }
+  *zero = (or == 0);
+  return (uint)(h ^ (h >> 32));
+}
+
+// Has hash h been seen during this pass? Records it if not.
+static int
+seen(uint h)
+{
+  uint key = h | 1;
+
+  for(int i = 0; i < 8; i++){
+    uint *s = &ksm.seen[(h + i) % NSEEN];
+    if(*s == key)
+      return 1;
+    if(*s == 0){
+      *s = key;
+      return 0;
+    }
+  }
+  return 0;   // neighbourhood full; forget it
+}
+
+// Try to merge q's page at va, mapped by pte.
+// Caller holds q->lock.
+static void
+ksmmerge(struct proc *q, uint64 va, pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  int flags = PTE_FLAGS(*pte) & ~PTE_W;
+  struct ksmpage *k;
+  uint h;
+  int zero;
+
+  h = pagehash(pa, &zero);
+  if(zero){
+    *pte = PA2PTE(zeropage) | flags;
+    uvmflush(q, va);
+    kfree((void*)pa);
+    __sync_fetch_and_add(&vmstats.ksmzero, 1);
+    return;
+  }
+
+  acquire(&ksm.lock);
+  for(k = ksm.byhash[h % NKSMHASH]; k; k = k->hnext){
+    if(k->hash == h && memcmp((void*)k->pa, (void*)pa, PGSIZE) == 0){
+      k->ref++;
+      ksm.nrefs++;
+      release(&ksm.lock);
+      *pte = PA2PTE(k->pa) | flags | PTE_COW;
+      uvmflush(q, va);
+      kfree((void*)pa);
+      __sync_fetch_and_add(&vmstats.ksmmerged, 1);
+      return;
+    }
+  }
+  if(seen(h) && (k = kmem_cache_alloc(ksm.cache)) != 0){
+    k->pa = pa;
+    k->hash = h;
+    k->ref = 1;
+    k->hnext = ksm.byhash[h % NKSMHASH];
+    ksm.byhash[h % NKSMHASH] = k;
+    k->pnext = ksm.bypa[PAHASH(pa)];
+    ksm.bypa[PAHASH(pa)] = k;
+    ksm.npages++;
+    ksm.nrefs++;
+    *pte = PA2PTE(pa) | flags | PTE_COW;
+    uvmflush(q, va);
+  }
+  release(&ksm.lock);
+}
+
+// Scan q from ksm.handva, hashing at most budget pages and
+// looking at most *walk PTEs. Returns the number hashed.
+// Caller holds q->lock.
+static int
+ksmscan(struct proc *q, int budget, int *walk)
+{
+  pte_t *pte;
+  int n = 0, level;
+  uint64 va;
+
+  for(va = ksm.handva; va < q->sz && n < budget && *walk > 0; va += PGSIZE){
+    --*walk;
+    if((pte = walklevel(q->pagetable, va, &level)) == 0 || level == 1){
+      // no page-table page, or a megapage: skip it.
+      va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if((*pte & (PTE_V|PTE_U|PTE_W|PTE_X|PTE_COW)) != (PTE_V|PTE_U|PTE_W))
+      continue;
+    n++;
+    ksmmerge(q, va, pte);
+  }
+  ksm.handva = va;
+  __sync_fetch_and_add(&vmstats.ksmscanned, n);
+  return n;
+}
+
+// Run the scanner for one tick's budget, if it is on.
+// Called by clockintr() on CPU 0.
+void
+ksmtick(void)
+{
+  struct proc *q;
+  int budget = KSMBUDGET, walk = KSMWALK;
+
+  if(!ksm.on)
+    return;
+  while(budget > 0 && walk > 0){
+    if(ksm.hand == 0 && (ksm.hand = procs) == 0)
+      return;
+    q = ksm.hand;
+    acquire(&q->lock);
+    // threads may be running with q's pages in their TLBs.
+    // futex.c also relies on these checks: a process sleeping
+    // in futex_wait() isn't swapok, and its futex word's page
+    // must keep its physical address, which is the futex key.
+    if(q->pagetable && q->swapok && q->leader->nthread == 1 &&
+       (q->state == RUNNABLE || q->state == SLEEPING))
+      budget -= ksmscan(q, budget, &walk);
+    else
+      ksm.handva = q->sz;
+    walk--;
+    if(ksm.handva >= q->sz){
+      ksm.handva = 0;
+      if((ksm.hand = q->allnext) == 0){
+        // end of a pass.
+        memset(ksm.seen, 0, sizeof(ksm.seen));
+      }
+    }
+    release(&q->lock);
+  }
+}
+
+// Fill in the merging part of the vmstat counters.
+void
+ksmstat(struct vmstat *st)
+{
+  acquire(&ksm.lock);
+  st->ksmpages = ksm.npages;
+  st->ksmsharing = ksm.nrefs;
+  release(&ksm.lock);
+}
@@ -17,8 +17,10 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small-object allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    asidinit();      // probe for address-space IDs
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
@@ -27,6 +29,9 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    ksminit();       // same-page merging
+    futexinit();     // futex locks
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -1,15 +1,25 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       512  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define MAXSPAWNACT  16  // max spawn() file actions
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGBLOCKS    (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
+#define SWAPBLOCKS   8192  // swap area after the file system, in blocks
+#define KMALLOC_MAX  1024  // largest kmalloc(); its caches use one-page slabs
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define FAULTAROUND  16    // default max pages mapped ahead of a sequential fault
+#define MAXFAULTAROUND 64  // upper limit for faultaround()
+#define NPRIO        3     // scheduler priority levels, 0 highest
+#define BOOSTTICKS   50    // ticks between priority boosts
+#define TIMEFREQ     10000000  // r_time() counts per second (qemu virt)
+#define TICKTIME     (TIMEFREQ/10) // r_time() counts per tick
+#define NLAT         24    // log2 buckets in scheduler latency histograms
+#define NTHREAD      16    // maximum threads per process, with the first
 
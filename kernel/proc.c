@@ -4,60 +4,125 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sched.h"
 #include "defs.h"
 #include "stat.h"
 #include "fs.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Process structures are allocated from a slab cache as they
+// are needed, up to NPROC of them, each with a kernel stack
+// mapped at KSTACK(n) for the nth. They are never freed: a
+// reaped process goes on a free list for allocproc() to reuse,
+// so code that holds a pointer to a struct proc without its
+// lock, such as the run queues and the clock hands of the
+// swapper and scanners, always points at one. procs lists
+// every struct proc, newest first; since entries are only ever
+// added at the head, it can be walked without a lock.
+// Processes with a pid are also hashed by pid.
+// Lock order: p->lock, then ptable.lock.
+#define NPIDHASH 64
+#define PIDHASH(pid) (&ptable.hash[(uint)(pid) % NPIDHASH])
+
+struct proc *procs;
+
+struct {
+  struct spinlock lock;       // protects the fields below
+  struct kmem_cache *cache;
+  int n;                      // struct procs allocated
+  int nextpid;
+  struct proc *free;          // UNUSED procs
+  struct proc *hash[NPIDHASH];
+  uint kstackgen;             // bumped each time a kernel stack is mapped
+} ptable;
 
 struct proc *initproc;
 
-int nextpid = 1;
-struct spinlock pid_lock;
+extern pagetable_t kernel_pagetable;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+// Sleeping processes, hashed by channel, so that wakeup()
+// looks only at processes sleeping on channels that hash
+// alike. A process is put on its channel's queue by sleep()
+// and taken off by the wakeup() that wakes it, or by sleep()
+// itself if something else, such as kkill(), woke it.
+// Lock order: condition lock, then waitq lock, then p->lock.
+#define NWAITQ 64
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitqs[NWAITQ];
+
+#define WAITQ(chan) (&waitqs[((uint64)(chan) * 0x9E3779B97F4A7C15UL) >> 58])
+
+// Multi-level feedback queue scheduling: a process starts at
+// priority 0 and runs for 1 << priority ticks at each level,
+// counted across sleeps, before dropping a level. Every
+// BOOSTTICKS ticks all processes go back to priority 0, so
+// that CPU-bound processes can't starve at the bottom level.
+// boostgen counts the boosts; each process and each CPU's
+// queues catch up with it lazily.
+#define QUANTUM(prio) (1 << (prio))
+
+#define ALLCPUS ((1UL << NCPU) - 1)
+#define CPUBIT(c) (1UL << ((c) - cpus))
+
+uint boostgen;
+
+// Threads. clone() creates a thread: a struct proc, with its
+// own pid, kernel stack and trapframe, that shares the page
+// table, size, open files and current directory of the process
+// that created it. The process's first thread, its leader, owns
+// all of these; every thread's p->pagetable points at the
+// leader's and p->sz is kept equal to the leader's, while files
+// and the directory are always used through p->leader. Each
+// thread's trapframe is mapped in one of NTHREAD slots below
+// TRAMPOLINE, the leader's at TRAPFRAME, and uservec finds it
+// through sscratch. A thread has no parent: another thread of
+// the process reaps it with join(). exit() in a thread ends only
+// it; in the leader, it first kills and reaps the other threads.
+//
+// Threads fault pages in concurrently, so user PTEs and
+// page-table pages are installed with compare-and-swap (see
+// vm.c). They share the leader's ASID. Nothing sends TLB
+// shootdowns to other CPUs, so while a process has more than
+// one thread, no valid PTE may lose a permission or change its
+// physical page: it can't shrink or drop pages, exec or be
+// checkpointed, the swapper and page merger pass it by, and
+// its zero-page and merged pages are copied when the second
+// thread is created (see uvmunshare()), so a write fault never
+// replaces one.
+//
+// vmlock() serializes clone() and changes to the size within a
+// process. Threads are added to the leader's nthread and tslots
+// under it, and taken off atomically by freeproc().
+struct spinlock thread_lock;  // protects vmbusy
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
-{
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
-}
-
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
-  initlock(&pid_lock, "nextpid");
+  initlock(&ptable.lock, "ptable");
+  ptable.cache = kmem_cache_create("proc", sizeof(struct proc));
+  ptable.nextpid = 1;
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  initlock(&thread_lock, "thread");
+  for(struct cpu *c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rqlock, "runq");
+  for(struct waitq *wq = waitqs; wq < &waitqs[NWAITQ]; wq++)
+    initlock(&wq->lock, "waitq");
 }
 
 // Must be called with interrupts disabled,
@@ -91,41 +156,117 @@ myproc(void)
   return p;
 }
 
-int
-allocpid()
+// Give p the next pid and hash it.
+// Caller holds p->lock.
+static void
+allocpid(struct proc *p)
 {
-  int pid;
-  
-  acquire(&pid_lock);
-  pid = nextpid;
-  nextpid = nextpid + 1;
-  release(&pid_lock);
+  struct proc **h;
+
+  acquire(&ptable.lock);
+  p->pid = ptable.nextpid++;
+  h = PIDHASH(p->pid);
+  p->hashnext = *h;
+  *h = p;
+  release(&ptable.lock);
+}
 
-  return pid;
+// Allocate a new struct proc, with a kernel stack mapped
+// below the others, for when the free list is empty.
+// Returns 0 if there are NPROC already or memory is short.
+static struct proc*
+newproc(void)
+{
+  struct proc *p;
+  char *stack = 0;
+
+  if((p = kmem_cache_alloc(ptable.cache)) == 0 || (stack = kalloc()) == 0)
+    goto bad;
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  p->state = UNUSED;
+
+  acquire(&ptable.lock);
+  p->kstack = KSTACK(ptable.n);
+  if(ptable.n >= NPROC ||
+     mappages(kernel_pagetable, p->kstack, PGSIZE, (uint64)stack, PTE_R | PTE_W) < 0){
+    release(&ptable.lock);
+    goto bad;
+  }
+  // even a PTE that was invalid needs a fence before use.
+  // other harts fence in scheduler() before running any
+  // process, once they see kstackgen change.
+  sfence_vma();
+  ptable.kstackgen++;
+  ptable.n++;
+  p->allnext = procs;
+  __sync_synchronize();
+  procs = p;
+  release(&ptable.lock);
+  return p;
+
+ bad:
+  if(stack)
+    kfree(stack);
+  if(p)
+    kmem_cache_free(ptable.cache, p);
+  return 0;
 }
 
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc from the free list, or allocate a new one.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. Unless thread is set, give it
+// a user page table of its own.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(int thread)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
+  acquire(&ptable.lock);
+  if((p = ptable.free) != 0)
+    ptable.free = p->hashnext;
+  release(&ptable.lock);
+  if(p == 0 && (p = newproc()) == 0)
+    return 0;
 
-found:
-  p->pid = allocpid();
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
+  allocpid(p);
   p->state = USED;
+  p->faultaround = FAULTAROUND;
+  p->fawindow = 0;
+  p->fanext = 0;
+  p->nfaultaround = 0;
+  p->seqva = p->seqend = 0;
+  p->swapok = 0;
+  p->wsactive = 0;
+  p->wsdue = 0;
+  p->wsstart = ticks;
+  p->wsavg = p->dirtyavg = 0;
+  p->rss = p->wss = p->wsdirty = 0;
+  p->asidgen = 0;
+  p->lastcpu = -1;
+  p->tlbflush = 0;
+  p->cpu = -1;
+  p->onrq = 0;
+  p->wqprev = 0;
+  p->priority = 0;
+  p->qticks = 0;
+  p->boostgen = boostgen;
+  p->utime = p->stime = 0;
+  p->lastcharge = 0;
+  p->affinity = ALLCPUS;
+  p->nmigrate = 0;
+  p->woken = 0;
+  memset(p->latwait, 0, sizeof(p->latwait));
+  memset(p->latwakeup, 0, sizeof(p->latwakeup));
+  p->leader = p;
+  p->tfva = TRAPFRAME;
+  p->nthread = 1;
+  p->tslots = 1;
+  p->vmbusy = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -135,8 +276,7 @@ found:
   }
 
   // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  if(!thread && (p->pagetable = proc_pagetable(p)) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
@@ -151,18 +291,39 @@ found:
   return p;
 }
 
-// free a proc structure and the data hanging from it,
-// including user pages.
+// free the data hanging from a proc structure, including
+// user pages, and put it on the free list.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
+  struct proc **pp;
+
+  acquire(&ptable.lock);
+  for(pp = PIDHASH(p->pid); *pp; pp = &(*pp)->hashnext){
+    if(*pp == p){
+      *pp = p->hashnext;
+      break;
+    }
+  }
+  p->hashnext = ptable.free;
+  ptable.free = p;
+  release(&ptable.lock);
+
+  if(p->leader && p->leader != p){
+    // a thread: the page table is the leader's.
+    uvmunmap(p->pagetable, p->tfva, 1, 0);
+    __sync_fetch_and_and(&p->leader->tslots, ~(1U << ((TRAPFRAME - p->tfva) / PGSIZE)));
+    __sync_fetch_and_sub(&p->leader->nthread, 1);
+    p->pagetable = 0;
+  }
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->leader = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -223,37 +384,85 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
-// Grow or shrink user memory by n bytes.
+// Keep the threads of process g from changing its size, and
+// from cloning, until vmunlock(). May sleep.
+static void
+vmlock(struct proc *g)
+{
+  acquire(&thread_lock);
+  while(g->vmbusy)
+    sleep(&g->vmbusy, &thread_lock);
+  g->vmbusy = 1;
+  release(&thread_lock);
+}
+
+static void
+vmunlock(struct proc *g)
+{
+  acquire(&thread_lock);
+  g->vmbusy = 0;
+  wakeup(&g->vmbusy);
+  release(&thread_lock);
+}
+
+// Set the size of process g, in all its threads.
+// Caller holds vmlock(g).
+static void
+setsz(struct proc *g, uint64 sz)
+{
+  struct proc *t;
+
+  g->sz = sz;
+  if(g->nthread == 1)
+    return;
+  for(t = procs; t; t = t->allnext)
+    if(t->leader == g)
+      t->sz = sz;
+}
+
+// Grow or shrink user memory by n bytes, allocating the pages
+// now unless lazy is set, in which case they are allocated as
+// they fault in.
 // Return 0 on success, -1 on failure.
 int
-growproc(int n)
+growproc(int n, int lazy)
 {
   uint64 sz;
-  struct proc *p = myproc();
+  struct proc *p = myproc(), *g = p->leader;
+  int r = 0;
 
+  vmlock(g);
   sz = p->sz;
   if(n > 0){
-    if(sz + n > TRAPFRAME) {
-      return -1;
-    }
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
-      return -1;
-    }
+    if(sz + n < sz || sz + n > MAXUVA)
+      r = -1;
+    else if(lazy)
+      sz += n;
+    else if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0)
+      r = -1;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // other threads' CPUs may still have the pages in their TLBs.
+    if(g->nthread > 1)
+      r = -1;
+    else if(uvmdealloc(p->pagetable, sz, sz + n) == sz)
+      r = -1;   // no memory to split a megapage
+    else
+      sz += n;
   }
-  p->sz = sz;
-  return 0;
+  if(r == 0)
+    setsz(g, sz);
+  vmunlock(g);
+  return r;
 }
 
 // Create a new process, copying the parent.
@@ -266,7 +475,7 @@ kfork(void)
   struct proc *p = myproc();
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
@@ -286,12 +495,15 @@ kfork(void)
 
   // increment reference counts on open file descriptors.
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+    if(p->leader->ofile[i])
+      np->ofile[i] = filedup(p->leader->ofile[i]);
+  np->cwd = idup(p->leader->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->faultaround = p->faultaround;
+  np->affinity = p->affinity;
+
   pid = np->pid;
 
   release(&np->lock);
@@ -301,12 +513,201 @@ kfork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Create a new process running the program at path, without
+// copying the caller's memory. The child starts with the
+// caller's open files and current directory, as after fork(),
+// modified by the nact file actions in act; then path is loaded
+// as by exec(). Returns the child's pid, or -1 if an action is
+// invalid or the program can't be loaded.
+int
+kspawn(char *path, char **argv, struct spawnact *act, int nact)
+{
+  int i, argc, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct file *f;
+
+  if((np = allocproc(0)) == 0)
+    return -1;
+  // np stays USED, so nothing else looks at it until it is
+  // made RUNNABLE below; loading the program may sleep.
+  release(&np->lock);
+
+  for(i = 0; i < NOFILE; i++)
+    if(p->leader->ofile[i])
+      np->ofile[i] = filedup(p->leader->ofile[i]);
+  np->cwd = idup(p->leader->cwd);
+
+  for(i = 0; i < nact; i++){
+    if(act[i].fd < 0 || act[i].fd >= NOFILE || np->ofile[act[i].fd] == 0)
+      goto bad;
+    switch(act[i].op){
+    case SPAWN_DUP2:
+      if(act[i].newfd < 0 || act[i].newfd >= NOFILE)
+        goto bad;
+      if(act[i].newfd == act[i].fd)
+        break;
+      f = filedup(np->ofile[act[i].fd]);
+      if(np->ofile[act[i].newfd])
+        fileclose(np->ofile[act[i].newfd]);
+      np->ofile[act[i].newfd] = f;
+      break;
+    case SPAWN_CLOSE:
+      fileclose(np->ofile[act[i].fd]);
+      np->ofile[act[i].fd] = 0;
+      break;
+    default:
+      goto bad;
+    }
+  }
+
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  if((argc = loadimage(np, path, argv)) < 0)
+    goto bad;
+  np->trapframe->a0 = argc;
+  np->faultaround = p->faultaround;
+  np->affinity = p->affinity;
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+
+ bad:
+  for(i = 0; i < NOFILE; i++){
+    if(np->ofile[i]){
+      fileclose(np->ofile[i]);
+      np->ofile[i] = 0;
+    }
+  }
+  begin_op();
+  iput(np->cwd);
+  end_op();
+  np->cwd = 0;
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
+}
+
+// Create a thread of the calling process that starts at fn(arg),
+// with its stack pointer at stack. fn must not return; the
+// thread ends with exit(). Returns the new thread's pid, or -1.
+int
+kclone(uint64 fn, uint64 stack, uint64 arg)
+{
+  struct proc *np;
+  struct proc *p = myproc(), *g = p->leader;
+  int slot, tid;
+
+  vmlock(g);
+  for(slot = 1; slot < NTHREAD; slot++)
+    if((g->tslots & (1U << slot)) == 0)
+      break;
+  // see "Threads." above.
+  if(slot == NTHREAD || (g->nthread == 1 && uvmunshare(p) < 0) ||
+     (np = allocproc(1)) == 0){
+    vmunlock(g);
+    return -1;
+  }
+
+  np->tfva = TRAPFRAME - slot*PGSIZE;
+  if(mappages(p->pagetable, np->tfva, PGSIZE, (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    freeproc(np);
+    release(&np->lock);
+    vmunlock(g);
+    return -1;
+  }
+  np->pagetable = p->pagetable;
+  np->sz = p->sz;
+  __sync_fetch_and_or(&g->tslots, 1U << slot);
+  __sync_fetch_and_add(&g->nthread, 1);
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+  np->trapframe->ra = 0;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->faultaround = p->faultaround;
+  np->affinity = p->affinity;
+  tid = np->pid;
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->leader = g;
+  np->parent = 0;
+  release(&wait_lock);
+  vmunlock(g);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
+  return tid;
+}
+
+// Reap one exited thread of p's process, or if there is none,
+// kill the others if kill is set. Returns the reaped thread's
+// pid, 0 if there are threads still running, or -1 if there are
+// no other threads. Caller holds wait_lock.
+static int
+reapthread(struct proc *p, int kill)
+{
+  struct proc *t, *g = p->leader;
+  int tid, n = 0;
+
+  for(t = procs; t; t = t->allnext){
+    if(t == p || t == g || t->leader != g)
+      continue;
+    acquire(&t->lock);
+    if(t->state == ZOMBIE){
+      tid = t->pid;
+      freeproc(t);
+      release(&t->lock);
+      return tid;
+    }
+    if(kill){
+      t->killed = 1;
+      if(t->state == SLEEPING)
+        setrunnable(t);
+    }
+    release(&t->lock);
+    n++;
+  }
+  return n > 0 ? 0 : -1;
+}
+
+// Wait for another thread of the calling process, other than
+// its leader, to exit, and reap it. Returns its pid, or -1 if
+// there are no such threads.
+int
+kjoin(void)
+{
+  struct proc *p = myproc();
+  int tid;
+
+  acquire(&wait_lock);
+  while((tid = reapthread(p, 0)) == 0 && !killed(p))
+    sleep(p->leader, &wait_lock);
+  release(&wait_lock);
+  return tid > 0 ? tid : -1;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -314,7 +715,7 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
+  for(pp = procs; pp; pp = pp->allnext){
     if(pp->parent == p){
       pp->parent = initproc;
       wakeup(initproc);
@@ -329,31 +730,43 @@ void
 kexit(int status)
 {
   struct proc *p = myproc();
+  int r;
 
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
+  if(p->leader == p){
+    // the other threads use the files and the page table
+    // too; kill them and wait for them to finish.
+    acquire(&wait_lock);
+    while((r = reapthread(p, 1)) >= 0)
+      if(r == 0)
+        sleep(p, &wait_lock);
+    release(&wait_lock);
+
+    // Close all open files.
+    for(int fd = 0; fd < NOFILE; fd++){
+      if(p->ofile[fd]){
+        struct file *f = p->ofile[fd];
+        fileclose(f);
+        p->ofile[fd] = 0;
+      }
     }
-  }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+    begin_op();
+    iput(p->cwd);
+    end_op();
+    p->cwd = 0;
+  }
 
   acquire(&wait_lock);
 
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
-  wakeup(p->parent);
+  // Parent might be sleeping in wait(), or for a
+  // thread, another thread in join().
+  wakeup(p->parent ? p->parent : p->leader);
   
   acquire(&p->lock);
 
@@ -376,12 +789,15 @@ kwait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // copyout() can't read a swapped-out page while locks are held.
+  if(addr != 0)
+    swapinrange(p->pagetable, addr, sizeof(int));
   acquire(&wait_lock);
 
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
+    for(pp = procs; pp; pp = pp->allnext){
       if(pp->parent == p){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
@@ -416,10 +832,291 @@ kwait(uint64 addr)
   }
 }
 
+// Apply any priority boost that p hasn't seen yet.
+// Caller holds p->lock.
+static void
+boostcheck(struct proc *p)
+{
+  if(p->boostgen != boostgen){
+    p->boostgen = boostgen;
+    p->priority = 0;
+    p->qticks = 0;
+  }
+}
+
+// p was just queued on c: wake c with an IPI if it is idle,
+// or else some other idle CPU that p may run on, which will
+// steal it.
+static void
+runqkick(struct cpu *c, struct proc *p)
+{
+  struct cpu *v;
+
+  // pairs with the barrier in cpuidle().
+  __sync_synchronize();
+  if(c->idle){
+    ipi(c - cpus);
+    return;
+  }
+  for(v = cpus; v < &cpus[NCPU]; v++){
+    if(v->idle && (p->affinity & CPUBIT(v))){
+      ipi(v - cpus);
+      return;
+    }
+  }
+}
+
+// Which CPU's run queue should p go on? The CPU that last ran
+// it, or else this CPU, or else the first online CPU, whichever
+// p's affinity allows first.
+static struct cpu*
+runqcpu(struct proc *p)
+{
+  struct cpu *c;
+
+  if(p->cpu >= 0 && (p->affinity & CPUBIT(&cpus[p->cpu])))
+    return &cpus[p->cpu];
+  if(p->affinity & CPUBIT(mycpu()))
+    return mycpu();
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    if(c->online && (p->affinity & CPUBIT(c)))
+      return c;
+  return mycpu();
+}
+
+// Make p RUNNABLE and put it on the run queue for its priority
+// of the CPU chosen by runqcpu(), unless it is already on a
+// queue. Unless p is the caller, yielding, wake an idle CPU to
+// run it. Caller holds p->lock.
+void
+setrunnable(struct proc *p)
+{
+  struct cpu *c;
+  struct runq *q;
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  p->state = RUNNABLE;
+  if(p->onrq)
+    return;
+  p->onrq = 1;
+  boostcheck(p);
+  p->readyts = r_time();
+  c = runqcpu(p);
+  p->rqcpu = c - cpus;
+  acquire(&c->rqlock);
+  q = &c->rq[p->priority];
+  p->rqnext = 0;
+  if(q->tail)
+    q->tail->rqnext = p;
+  else
+    q->head = p;
+  q->tail = p;
+  c->nrunq++;
+  release(&c->rqlock);
+  if(p != myproc())
+    runqkick(c, p);
+}
+
+// Move everything on c's lower-priority queues to the end of
+// its priority-0 queue, if there has been a boost since the
+// last time.
+static void
+runqboost(struct cpu *c)
+{
+  struct runq *q0 = &c->rq[0];
+
+  acquire(&c->rqlock);
+  for(struct runq *q = &c->rq[1]; q < &c->rq[NPRIO]; q++){
+    if(q->head == 0)
+      continue;
+    if(q0->tail)
+      q0->tail->rqnext = q->head;
+    else
+      q0->head = q->head;
+    q0->tail = q->tail;
+    q->head = q->tail = 0;
+  }
+  c->boostgen = boostgen;
+  release(&c->rqlock);
+}
+
+// Take the first process, in priority order, on c's run queues
+// that may run on CPU t, or return 0.
+// The process's onrq stays set until the caller, holding
+// its p->lock, clears it.
+static struct proc*
+runqget(struct cpu *c, struct cpu *t)
+{
+  struct proc *p = 0, *prev;
+  struct runq *q;
+
+  acquire(&c->rqlock);
+  for(q = c->rq; q < &c->rq[NPRIO] && p == 0; q++){
+    for(prev = 0, p = q->head; p; prev = p, p = p->rqnext)
+      if(p->affinity & CPUBIT(t))
+        break;
+    if(p == 0)
+      continue;
+    if(prev)
+      prev->rqnext = p->rqnext;
+    else
+      q->head = p->rqnext;
+    if(q->tail == p)
+      q->tail = prev;
+    c->nrunq--;
+  }
+  release(&c->rqlock);
+  return p;
+}
+
+// Take p off the run queue it is on, if it is still there.
+// Caller holds p->lock.
+static void
+runqremove(struct proc *p)
+{
+  struct cpu *c = &cpus[p->rqcpu];
+  struct proc **pp, *prev;
+  struct runq *q;
+
+  acquire(&c->rqlock);
+  for(q = c->rq; q < &c->rq[NPRIO]; q++){
+    for(prev = 0, pp = &q->head; *pp; prev = *pp, pp = &(*pp)->rqnext){
+      if(*pp == p){
+        *pp = p->rqnext;
+        if(q->tail == p)
+          q->tail = prev;
+        c->nrunq--;
+        p->onrq = 0;
+        release(&c->rqlock);
+        return;
+      }
+    }
+  }
+  release(&c->rqlock);
+}
+
+// This CPU's run queues are empty: take a process that may run
+// here from the CPU with the longest queue, or failing that from
+// any CPU. Returns 0 if there is none.
+static struct proc*
+runqsteal(struct cpu *c)
+{
+  struct cpu *v, *busiest = 0;
+  struct proc *p;
+
+  // the lengths are read without locks; runqget() checks.
+  for(v = cpus; v < &cpus[NCPU]; v++)
+    if(v != c && v->nrunq > 0 && (busiest == 0 || v->nrunq > busiest->nrunq))
+      busiest = v;
+  if(busiest == 0)
+    return 0;
+  if((p = runqget(busiest, c)) != 0)
+    return p;
+  for(v = cpus; v < &cpus[NCPU]; v++)
+    if(v != c && v != busiest && v->nrunq > 0 && (p = runqget(v, c)) != 0)
+      return p;
+  return 0;
+}
+
+// Is any process waiting on any CPU's run queue?
+static int
+runqwaiting(void)
+{
+  for(struct cpu *v = cpus; v < &cpus[NCPU]; v++)
+    if(v->nrunq > 0)
+      return 1;
+  return 0;
+}
+
+// Wait for an interrupt, with nothing to run. runqkick() sends
+// an IPI to a CPU that has c->idle set, so check the queues again
+// after setting it, in case a process was queued just before.
+// In tickless mode, CPUs other than 0, which keeps time, turn
+// their timer off; the scheduler turns it back on.
+static void
+cpuidle(struct cpu *c)
+{
+  c->idle = 1;
+  __sync_synchronize();
+  if(!runqwaiting()){
+    if(tickless && c != cpus){
+      w_stimecmp(-1);
+      c->tickless = 1;
+    }
+    asm volatile("wfi");
+  }
+  c->idle = 0;
+}
+
+// Histogram bucket for a latency of d r_time() counts.
+static int
+latbucket(uint64 d)
+{
+  int b = 0;
+
+  while(d >= 2 && b < NLAT-1){
+    d >>= 1;
+    b++;
+  }
+  return b;
+}
+
+// c is about to switch to p at time now: record how long p
+// waited to run, and how long c took to switch to it.
+// Caller holds p->lock.
+static void
+schedlat(struct cpu *c, struct proc *p, uint64 now)
+{
+  int b = latbucket(now - p->readyts);
+
+  p->latwait[b]++;
+  c->latwait[b]++;
+  if(p->woken){
+    p->latwakeup[b]++;
+    c->latwakeup[b]++;
+    p->woken = 0;
+  }
+  if(c->schedts){
+    c->latswtch[latbucket(now - c->schedts)]++;
+    c->schedts = 0;
+  }
+}
+
+// Copy the latency histograms of process pid, if pid > 0, or
+// else of CPU cpu, to *st. Returns 0, or -1 if there is no
+// such process or CPU.
+int
+kschedstat(int pid, int cpu, struct schedstat *st)
+{
+  struct proc *p;
+  struct cpu *c;
+
+  memset(st, 0, sizeof(*st));
+  if(pid > 0){
+    if((p = findproc(pid)) == 0)
+      return -1;
+    memmove(st->wait, p->latwait, sizeof(st->wait));
+    memmove(st->wakeup, p->latwakeup, sizeof(st->wakeup));
+    release(&p->lock);
+    return 0;
+  }
+  if(cpu < 0 || cpu >= NCPU)
+    return -1;
+  // each CPU updates its own counters without a lock; a
+  // snapshot may be slightly out of date.
+  c = &cpus[cpu];
+  memmove(st->wait, c->latwait, sizeof(st->wait));
+  memmove(st->wakeup, c->latwakeup, sizeof(st->wakeup));
+  memmove(st->swtch, c->latswtch, sizeof(st->swtch));
+  return 0;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process from this CPU's run queue, or
+//    steal one from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -430,6 +1127,7 @@ scheduler(void)
   struct cpu *c = mycpu();
 
   c->proc = 0;
+  c->online = 1;
   for(;;){
     // The most recent process to run may have had interrupts
     // turned off; enable them to avoid a deadlock if all
@@ -439,31 +1137,70 @@ scheduler(void)
     intr_on();
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
-      }
+    if(c->boostgen != boostgen)
+      runqboost(c);
+    if((p = runqget(c, c)) == 0 && (p = runqsteal(c)) == 0){
+      c->schedts = 0;
+      // nothing to run; zero a page for kalloc_zeroed(), or if
+      // there's no need, stop running on this core until an interrupt.
+      if(kzerofill() == 0)
+        cpuidle(c);
+      continue;
+    }
+
+    acquire(&p->lock);
+    p->onrq = 0;
+    // its affinity may have changed since runqget() looked.
+    if(p->state == RUNNABLE && !(p->affinity & CPUBIT(c))){
+      setrunnable(p);
       release(&p->lock);
+      continue;
     }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      asm volatile("wfi");
+    // it may have been stopped, e.g. by proc_checkpoint(),
+    // since it was queued.
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      if(p->cpu >= 0 && p->cpu != c - cpus)
+        p->nmigrate++;
+      p->cpu = c - cpus;
+      if(c->kstackgen != ptable.kstackgen){
+        // p's kernel stack may have been mapped since
+        // this hart last fenced.
+        c->kstackgen = ptable.kstackgen;
+        sfence_vma();
+      }
+      p->lastcharge = r_time();
+      schedlat(c, p, p->lastcharge);
+      c->proc = p;
+      if(c->tickless){
+        c->tickless = 0;
+        w_stimecmp(r_time() + quantum);
+      }
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
   }
 }
 
+// Charge the time since p was last charged to p's user time
+// if user is set, else to its system time.
+static void
+charge(struct proc *p, int user, uint64 now)
+{
+  if(user)
+    p->utime += now - p->lastcharge;
+  else
+    p->stime += now - p->lastcharge;
+  p->lastcharge = now;
+}
+
 // Switch to scheduler.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
@@ -487,17 +1224,126 @@ sched(void)
     panic("sched interruptible");
 
   intena = mycpu()->intena;
+  mycpu()->schedts = r_time();
+  // the rest of the slice, since the last timer interrupt,
+  // was spent in the kernel.
+  charge(p, 0, mycpu()->schedts);
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
 }
 
+// Called on a timer interrupt, once a quantum, for p, which is
+// running on this CPU. Charges the time since p was last charged
+// to p's user time if user is set, else to its system time.
+// Returns 1 if p should yield: it has used up its quantum, and
+// so drops a priority level, or a higher-priority process is
+// waiting here.
+int
+schedtick(struct proc *p, int user)
+{
+  struct cpu *c = mycpu();
+  uint64 now = r_time();
+  int r = 0;
+
+  acquire(&p->lock);
+  charge(p, user, now);
+  boostcheck(p);
+  if(++p->qticks >= QUANTUM(p->priority)){
+    p->qticks = 0;
+    if(p->priority < NPRIO-1)
+      p->priority++;
+    r = 1;
+  } else {
+    // the queue heads are read without the lock; a stale
+    // answer only delays or hastens a switch by a tick.
+    for(int l = 0; l < p->priority; l++)
+      if(c->rq[l].head)
+        r = 1;
+  }
+  release(&p->lock);
+  return r;
+}
+
+// Called by clockintr() on CPU 0 once per tick.
+void
+schedclock(void)
+{
+  static uint lastboost;
+
+  if(ticks - lastboost >= BOOSTTICKS){
+    lastboost = ticks;
+    boostgen++;
+  }
+}
+
+// Set the priority of process pid to prio, from 0 (highest)
+// to NPRIO-1, with a fresh quantum. A process that is already
+// queued moves when it is next queued. Returns the old
+// priority, or -1 if there is no such process or prio is out of range.
+int
+ksetpriority(int pid, int prio)
+{
+  struct proc *p;
+  int old;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  if((p = findproc(pid)) == 0)
+    return -1;
+  boostcheck(p);
+  old = p->priority;
+  p->priority = prio;
+  p->qticks = 0;
+  release(&p->lock);
+  return old;
+}
+
+// Restrict process pid to the CPUs in mask, one bit per CPU.
+// A queued process moves to a queue it is allowed on now; a
+// running one moves when it next yields, which the caller does
+// at once. Returns 0, or -1 if there is no such process or mask
+// has no online CPU.
+int
+ksetaffinity(int pid, uint64 mask)
+{
+  struct proc *p;
+  struct cpu *c;
+  int online = 0;
+
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    if(c->online && (mask & CPUBIT(c)))
+      online = 1;
+  if(!online)
+    return -1;
+  if((p = findproc(pid)) == 0)
+    return -1;
+  p->affinity = mask & ALLCPUS;
+  if(p->onrq && !(p->affinity & CPUBIT(&cpus[p->rqcpu]))){
+    runqremove(p);
+    // if runqremove() didn't find it, a scheduler has
+    // taken it and will requeue it.
+    if(!p->onrq && p->state == RUNNABLE)
+      setrunnable(p);
+  }
+  release(&p->lock);
+
+  if(p == myproc()){
+    push_off();
+    c = mycpu();
+    pop_off();
+    if(!(p->affinity & CPUBIT(c)))
+      yield();
+  }
+  return 0;
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -534,39 +1380,66 @@ forkret(void)
 
   // return to user space, mimicing usertrap()'s return.
   prepare_return();
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = uvmswitch(p);
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
   ((void (*)(uint64))trampoline_userret)(satp);
 }
 
+// Take p off the wait queue wq. Caller holds wq->lock.
+static void
+waitqremove(struct proc *p)
+{
+  if(p->wqnext)
+    p->wqnext->wqprev = p->wqprev;
+  *p->wqprev = p->wqnext;
+  p->wqprev = 0;
+}
+
 // Sleep on channel chan, releasing condition lock lk.
 // Re-acquires lk when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = WAITQ(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the wait queue's lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks it),
   // so it's okay to release lk.
 
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = wq->head;
+  if(wq->head)
+    wq->head->wqprev = &p->wqnext;
+  p->wqprev = &wq->head;
+  wq->head = p;
+  release(&wq->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  // wakeup() took p off the queue, unless something else
+  // woke it. only this process sets wqprev, so it's safe to
+  // look without the lock.
+  if(p->wqprev){
+    acquire(&wq->lock);
+    waitqremove(p);
+    release(&wq->lock);
+  }
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
@@ -575,17 +1448,35 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeupn(chan, -1);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+// Wake up at most n processes sleeping on channel chan, or all
+// of them if n is negative. Returns the number woken.
+// Caller should hold the condition lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct waitq *wq = WAITQ(chan);
+  struct proc *p, *next;
+  int woken = 0;
+
+  acquire(&wq->lock);
+  for(p = wq->head; p && woken != n; p = next) {
+    next = p->wqnext;
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        waitqremove(p);
+        setrunnable(p);
+        p->woken = 1;
+        woken++;
       }
       release(&p->lock);
     }
   }
+  release(&wq->lock);
+  return woken;
 }
 
 // Kill the process with the given pid.
@@ -596,20 +1487,15 @@ kkill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
+  if((p = findproc(pid)) == 0)
+    return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrunnable(p);
   }
-  return -1;
+  release(&p->lock);
+  return 0;
 }
 
 void
@@ -661,22 +1547,27 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+// Look up process pid in the pid hash.
+// Returns it with p->lock held, or 0 if there is none.
 struct proc*
 findproc(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock); // Lock the process
-    if(p->pid == pid && p->state != UNUSED) {
-      // Found it. Return with the lock HELD.
-      return p;
-    }
-    release(&p->lock); // Not this one. Release lock and keep looping.
-  }
+  acquire(&ptable.lock);
+  for(p = *PIDHASH(pid); p && p->pid != pid; p = p->hashnext)
+    ;
+  release(&ptable.lock);
+  if(p == 0)
+    return 0;
 
-  // Did not find
-  return 0;
+  acquire(&p->lock);
+  // it may have been reaped, and even reused, meanwhile.
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
 }
 
 // Print a process listing to console.  For debugging.
@@ -697,7 +1588,7 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = procs; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -713,7 +1604,7 @@ procdump(void)
 // CHECKPOINT & RESTORE HELPERS (proc-level orchestration)
 // =================================================================
 
-#define CHKPT_MAGIC 0x58563643 // ASCII for "XV6C"
+#define CHKPT_MAGIC 0x58563644 // ASCII for "XV6D"; "XV6C" had no page map
 
 struct chkpt_header {
   uint magic;      //  File Type Signature
@@ -725,13 +1616,13 @@ struct chkpt_header {
 static int
 chkpt_valid_usersz(uint64 sz)
 {
-  // User memory must stay below TRAPFRAME in xv6-riscv.
-  if(sz > TRAPFRAME)
+  // User memory must stay below the trapframes in xv6-riscv.
+  if(sz > MAXUVA)
     return 0;
   uint64 a = PGROUNDUP(sz);
   if(a < sz)
     return 0;
-  if(a > TRAPFRAME)
+  if(a > MAXUVA)
     return 0;
   return 1;
 }
@@ -741,23 +1632,20 @@ chkpt_valid_usersz(uint64 sz)
 int
 proc_checkpoint(int target_pid, char *filename)
 {
-  struct proc *p, *tp = 0;
+  struct proc *tp;
   struct inode *ip = 0;
   struct chkpt_header h;
   struct trapframe tf_copy;
   int frozen_wait_cycles = 0;
 
   // 1. Find target process & Freeze (Option E Logic)
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == target_pid){
-      tp = p;
-      break; 
-    }
-    release(&p->lock);
-  }
+  if((tp = findproc(target_pid)) == 0) return -1;
 
-  if(tp == 0) return -1;
+  // only the one thread would be frozen and saved.
+  if(tp->leader->nthread > 1){
+    release(&tp->lock);
+    return -1;
+  }
 
   // Wait for RUNNING process to yield (Race Condition Avoidance)
   while(tp->state == RUNNING){
@@ -837,7 +1725,10 @@ proc_checkpoint(int target_pid, char *filename)
 
   // Thaw
   acquire(&tp->lock);
-  tp->state = old_state;
+  if(old_state == RUNNABLE)
+    setrunnable(tp);
+  else
+    tp->state = old_state;
   release(&tp->lock);
 
   printf("chkpt: Saved process %d (Magic: %x, Checksum: %x)\n", h.pid, h.magic, h.checksum);
@@ -858,7 +1749,10 @@ fail_unlocked:
 
 fail_thaw:
   acquire(&tp->lock);
-  tp->state = old_state;
+  if(old_state == RUNNABLE)
+    setrunnable(tp);
+  else
+    tp->state = old_state;
   release(&tp->lock);
   return -1;
 }
@@ -915,14 +1809,6 @@ proc_restore(char *path)
     goto bad_locked;
   }
 
-  if(sz_aligned > 0){
-    if(uvmalloc(newpt, 0, sz_aligned, PTE_R | PTE_W | PTE_X | PTE_U) == 0){
-      printf("restore: uvmalloc failed\n");
-      proc_freepagetable(newpt, 0);
-      goto bad_locked;
-    }
-  }
-
   // 5. Restore Memory & Verify Checksum (Option C Logic)
   uint32 calc_crc = 0;
   if(vm_restore_integrity(newpt, ip, &off, h.sz, &calc_crc) < 0){
@@ -945,6 +1831,7 @@ proc_restore(char *path)
   // Swap in new address space
   proc_freepagetable(oldpt, oldsz);
   p->pagetable = newpt;
+  p->tlbflush = 1;
   p->sz = h.sz;
 
   // Install trapframe
@@ -24,6 +24,26 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation the TLB was flushed for
+  uint kstackgen;             // kernel stacks mapped when this hart last fenced
+
+  // run queues of RUNNABLE processes, one per priority
+  // level, each in FIFO order.
+  struct spinlock rqlock;     // protects the fields below
+  struct runq {
+    struct proc *head;
+    struct proc *tail;
+  } rq[NPRIO];
+  int nrunq;                  // processes on the queues
+  uint boostgen;              // priority boost the queues reflect
+
+  int idle;                   // in wfi with nothing to run; wake with an IPI
+  int tickless;               // timer turned off while idle
+  int online;                 // has entered scheduler()
+  uint64 schedts;             // r_time() at the last sched() here, or 0
+  uint64 latwait[NLAT];       // latency histograms; see sched.h
+  uint64 latwakeup[NLAT];
+  uint64 latswtch[NLAT];
 };
 
 extern struct cpu cpus[NCPU];
@@ -77,6 +97,7 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 tlbflush;      // no ASIDs: uservec flushes the TLB
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
@@ -92,8 +113,9 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  // wait_lock must be held when using this:
-  struct proc *parent;         // Parent process
+  // wait_lock must be held when using these:
+  struct proc *parent;         // Parent process; 0 for a thread
+  struct proc *leader;         // First thread of the process; p itself for it
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -101,11 +123,75 @@ struct proc {
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct file *ofile[NOFILE];  // Open files; threads use the leader's
+  struct inode *cwd;           // Current directory; likewise
   char name[16];               // Process name (debugging)
+  uint64 tfva;                 // Where the trapframe is mapped
+
+  // threads, in the leader only; see vmlock().
+  int nthread;                 // Threads, including the leader
+  uint tslots;                 // Trapframe slots in use, one bit each
+  int vmbusy;                  // A thread holds vmlock()
+
+  // lazy-fault state, private to the process.
+  int faultaround;             // Max pages mapped ahead of a sequential fault
+  int fawindow;                // Pages mapped ahead on the last fault
+  uint64 fanext;               // Page after the last fault-around batch
+  uint64 nfaultaround;         // Faults saved by fault-around
+  uint64 seqva, seqend;        // madvise(MADV_SEQUENTIAL) range
+
+  // working-set sampler state; p->lock must be held.
+  int wsactive;                // A sampling pass is under way
+  int wsdue;                   // Pass due while running; scan at next tick
+  uint wsstart;                // ticks when the last pass ended
+  uint64 wsva;                 // Next address to scan in this pass
+  int wsnrss, wsnhot, wsndirty; // Counts so far in this pass
+  int wsavg, dirtyavg;         // Decaying averages, in 1/WSSCALE pages
+  int rss;                     // Resident pages, as of the last pass
+  int wss;                     // Working-set estimate, in pages
+  int wsdirty;                 // Dirty-page estimate, in pages
+
+  // set while the process is preempted or sleeping at a point
+  // where its user pages may be swapped out or merged; only
+  // examined, under p->lock, while the process isn't RUNNING.
+  int swapok;
+
+  // address-space ID; see uvmswitch().
+  uint64 asid;                 // ASID tagging TLB entries; threads use the leader's
+  uint64 asidgen;              // generation asid was allocated in
+  int lastcpu;                 // CPU that last ran the process in user space
+  int tlbflush;                // PTEs changed while not running
+
+  // run-queue state; p->lock must be held, and also the
+  // queue's rqlock to change rqnext.
+  int cpu;                     // CPU that last ran the process, or -1
+  int onrq;                    // On a CPU's run queue
+  int rqcpu;                   // Whose queue, if onrq
+  struct proc *rqnext;         // Next on the run queue
+  uint64 affinity;             // CPUs the process may run on, one bit each
+  uint64 nmigrate;             // Times it ran on a different CPU than before
+  uint64 readyts;              // r_time() when last made RUNNABLE
+  int woken;                   // and whether by wakeup()
+  uint64 latwait[NLAT];        // latency histograms; see sched.h
+  uint64 latwakeup[NLAT];
+
+  // scheduling state; p->lock must be held.
+  int priority;                // Run-queue level, 0 (highest) to NPRIO-1
+  int qticks;                  // Ticks used at this level
+  uint boostgen;               // Last priority boost applied
+  uint64 utime;                // Time charged in user mode, in r_time() units
+  uint64 stime;                // Time charged in the kernel
+  uint64 lastcharge;           // r_time() when time was last charged
+
+  // wait-queue links, protected by the queue's lock; see sleep().
+  struct proc *wqnext;
+  struct proc **wqprev;        // 0 if not on a wait queue
+
+  // process table links; see allocproc().
+  struct proc *allnext;        // next on procs; set once
+  struct proc *hashnext;       // pid hash chain, or free list
 };
 
 // Per-process information for the procinfo syscall
-extern struct proc proc[NPROC];
+extern struct proc *procs;
 struct proc* findproc(int pid);
\ No newline at end of file
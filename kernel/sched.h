@@ -0,0 +1,11 @@
+// Scheduler latency histograms, reported by the schedstat()
+// system call. Bucket i counts latencies of 2^i to 2^(i+1)-1
+// r_time() counts (TIMEFREQ per second); bucket 0 also counts
+// shorter ones, and bucket NLAT-1 longer ones.
+// Needs param.h for NLAT.
+struct schedstat {
+  uint64 wait[NLAT];   // RUNNABLE to RUNNING, for any reason
+  uint64 wakeup[NLAT]; // woken by wakeup() to RUNNING
+  uint64 swtch[NLAT];  // sched() to the next process running on
+                       // the CPU, if it didn't go idle; per CPU only
+};
@@ -0,0 +1,270 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// A cache hands out objects of one size. Objects are carved
+// out of slabs of 2^order contiguous pages from kalloc_pages().
+// Each slab starts with a struct slab header; since slabs are
+// aligned to their size, an object's slab is found by rounding
+// its address down. Each CPU keeps a small magazine of free
+// objects per cache, so most allocations and frees don't take
+// the cache's lock.
+//
+// kmalloc() and kmfree() serve general requests of up to
+// KMALLOC_MAX bytes from a set of power-of-two caches.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "vm.h"
+
+#define MAGSIZE      16     // objects per per-CPU magazine
+#define NCACHE       32     // maximum number of caches
+#define KMALLOC_MIN  16
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;        // on cache->partial
+  struct slab *prev;
+  void *freelist;           // free objects in this slab
+  int inuse;                // objects handed out
+};
+
+// an object's address rounded down to its slab.
+#define SLABHDR(c, obj) \
+  ((struct slab*)((uint64)(obj) & ~(((uint64)PGSIZE << (c)->order) - 1)))
+
+#define SLABFIRST  ((sizeof(struct slab) + 15) & ~15)  // offset of first object
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;                // object size
+  int order;                // slabs are 2^order pages
+  int perslab;              // objects per slab
+  struct slab partial;      // list head: slabs with free objects
+  int nslab;                // slabs allocated
+  struct magazine mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} slabs;
+
+// kmalloc size classes, KMALLOC_MIN to KMALLOC_MAX bytes.
+static struct kmem_cache *kmalloc_caches[7];
+static char *kmalloc_names[] = {
+  "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+  "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+  for(int i = 0; i < NELEM(kmalloc_names); i++)
+    kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], KMALLOC_MIN << i);
+}
+
+// Create a cache of objects of the given size.
+// Caches are never destroyed.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+  int order;
+
+  size = (size + 7) & ~7;   // room for the free-list link, aligned
+  // the smallest slab that holds an object. kmfree()
+  // relies on this being order 0 for the kmalloc sizes.
+  for(order = 0; order < KNORDER; order++)
+    if(((uint64)PGSIZE << order) - SLABFIRST >= size)
+      break;
+  if(order == KNORDER)
+    panic("kmem_cache_create: size");
+
+  acquire(&slabs.lock);
+  if(slabs.n >= NCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->order = order;
+  c->perslab = (((uint64)PGSIZE << order) - SLABFIRST) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  c->nslab = 0;
+  for(int i = 0; i < NCPU; i++)
+    c->mag[i].n = 0;
+  return c;
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+}
+
+static void
+slab_unlink(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+// Allocate a new slab and put all of its objects on its
+// free list. Caller holds c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = kalloc_pages(c->order)) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->freelist = 0;
+  obj = (char*)s + SLABFIRST + (c->perslab - 1) * c->size;
+  for(int i = 0; i < c->perslab; i++, obj -= c->size){
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+  }
+  slab_link(c, s);
+  c->nslab++;
+  return s;
+}
+
+// Take one object from a partial slab, growing the cache
+// if there is none. Caller holds c->lock.
+static void*
+slab_take(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  s = c->partial.next;
+  if(s == &c->partial && (s = slab_grow(c)) == 0)
+    return 0;
+  obj = s->freelist;
+  s->freelist = *(void**)obj;
+  s->inuse++;
+  if(s->freelist == 0)
+    slab_unlink(s);   // now full
+  return obj;
+}
+
+// Return one object to its slab, and give the slab back
+// to the page allocator if it is now empty and another
+// partial slab remains. Caller holds c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = SLABHDR(c, obj);
+
+  if(s->cache != c || s->inuse <= 0)
+    panic("slab_put");
+  if(s->freelist == 0)
+    slab_link(c, s);  // was full
+  *(void**)obj = s->freelist;
+  s->freelist = obj;
+  s->inuse--;
+  if(s->inuse == 0 && (c->partial.next != s || s->next != &c->partial)){
+    slab_unlink(s);
+    c->nslab--;
+    kfree_pages(s, c->order);
+  }
+}
+
+// Allocate one object from cache c.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    // refill half a magazine from the slabs.
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (obj = slab_take(c)) != 0)
+      m->obj[m->n++] = obj;
+    release(&c->lock);
+  }
+  obj = 0;
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Return an object obtained from kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  if(SLABHDR(c, obj)->cache != c)
+    panic("kmem_cache_free");
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    // magazine full; give half back to the slabs.
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slab_put(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
+
+// Allocate n bytes, n <= KMALLOC_MAX.
+// Returns 0 if out of memory.
+void*
+kmalloc(uint n)
+{
+  int i;
+
+  if(n > KMALLOC_MAX)
+    panic("kmalloc: too big");
+  for(i = 0; (KMALLOC_MIN << i) < n; i++)
+    ;
+  return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  kmem_cache_free(s->cache, obj);
+}
+
+// Pages held by all caches' slabs, for vmstat.
+uint64
+slabpages(void)
+{
+  uint64 n = 0;
+
+  for(int i = 0; i < slabs.n; i++)
+    n += (uint64)slabs.cache[i].nslab << slabs.cache[i].order;
+  return n;
+}
@@ -6,10 +6,17 @@
 
 void main();
 void timerinit();
+void ipiinit(int);
 
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
+// scratch space for ipivec in kernelvec.S, two words per CPU.
+uint64 ipiscratch[NCPU][2];
+
+// in kernelvec.S.
+void ipivec();
+
 // entry.S jumps here in machine mode on stack0.
 void
 start()
@@ -30,7 +37,7 @@ start()
   // delegate all interrupts and exceptions to supervisor mode.
   w_medeleg(0xffff);
   w_mideleg(0xffff);
-  w_sie(r_sie() | SIE_SEIE | SIE_STIE);
+  w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
   // configure Physical Memory Protection to give supervisor mode
   // access to all of physical memory.
@@ -42,6 +49,7 @@ start()
 
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
+  ipiinit(id);
   w_tp(id);
 
   // switch to supervisor mode and jump to main().
@@ -58,9 +66,23 @@ timerinit()
   // enable the sstc extension (i.e. stimecmp).
   w_menvcfg(r_menvcfg() | (1L << 63)); 
   
-  // allow supervisor to use stimecmp and time.
-  w_mcounteren(r_mcounteren() | 2);
+  // allow supervisor to use stimecmp and time, and to let
+  // user programs read cycle and time.
+  w_mcounteren(r_mcounteren() | 3);
   
   // ask for the very first timer interrupt.
   w_stimecmp(r_time() + 1000000);
 }
+
+// let other harts interrupt this one. a hart can't raise a
+// supervisor software interrupt on another, so it raises a
+// machine-mode one through the CLINT, and ipivec passes it
+// down to supervisor mode. ipivec is the handler for every
+// machine-mode trap, so it checks mcause first.
+void
+ipiinit(int id)
+{
+  w_mscratch((uint64)ipiscratch[id]);
+  w_mtvec((uint64)ipivec);
+  w_mie(r_mie() | MIE_MSIE);
+}
@@ -1,13 +1,35 @@
 #include "types.h"
 
+// memset, memcmp and memmove work a word at a time, four
+// words per loop iteration, when the addresses allow it, and a
+// byte at a time on unaligned heads and tails. They handle
+// kalloc()'s junk fills, block copies in the buffer cache and
+// the log, and page copies in vm.c and the checkpointer.
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = dst;
+  uint64 w;
+
+  if(n >= 32){
+    for(; (uint64)d & 7; n--)
+      *d++ = c;
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    for(; n >= 32; n -= 32, d += 32){
+      ((uint64*)d)[0] = w;
+      ((uint64*)d)[1] = w;
+      ((uint64*)d)[2] = w;
+      ((uint64*)d)[3] = w;
+    }
+    for(; n >= 8; n -= 8, d += 8)
+      *(uint64*)d = w;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -18,6 +40,15 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if(n >= 16 && ((uint64)s1 & 7) == ((uint64)s2 & 7)){
+    for(; (uint64)s1 & 7; n--, s1++, s2++)
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    // the byte loop below finds the difference in a word
+    // that doesn't match.
+    for(; n >= 8 && *(uint64*)s1 == *(uint64*)s2; n -= 8)
+      s1 += 8, s2 += 8;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -30,8 +61,9 @@ memcmp(const void *v1, const void *v2, uint n)
 void*
 memmove(void *dst, const void *src, uint n)
 {
-  const char *s;
-  char *d;
+  const uchar *s;
+  uchar *d;
+  uint64 w0, w1, w2, w3;
 
   if(n == 0)
     return dst;
@@ -41,11 +73,51 @@ memmove(void *dst, const void *src, uint n)
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(n >= 32 && ((uint64)s & 7) == ((uint64)d & 7)){
+      for(; (uint64)d & 7; n--)
+        *--d = *--s;
+      // each group of words is loaded before any of it is
+      // stored, since the ranges overlap.
+      for(; n >= 32; n -= 32){
+        s -= 32;
+        d -= 32;
+        w0 = ((uint64*)s)[0];
+        w1 = ((uint64*)s)[1];
+        w2 = ((uint64*)s)[2];
+        w3 = ((uint64*)s)[3];
+        ((uint64*)d)[3] = w3;
+        ((uint64*)d)[2] = w2;
+        ((uint64*)d)[1] = w1;
+        ((uint64*)d)[0] = w0;
+      }
+      for(; n >= 8; n -= 8){
+        s -= 8;
+        d -= 8;
+        *(uint64*)d = *(uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(n >= 32 && ((uint64)s & 7) == ((uint64)d & 7)){
+      for(; (uint64)d & 7; n--)
+        *d++ = *s++;
+      for(; n >= 32; n -= 32, s += 32, d += 32){
+        w0 = ((uint64*)s)[0];
+        w1 = ((uint64*)s)[1];
+        w2 = ((uint64*)s)[2];
+        w3 = ((uint64*)s)[3];
+        ((uint64*)d)[0] = w0;
+        ((uint64*)d)[1] = w1;
+        ((uint64*)d)[2] = w2;
+        ((uint64*)d)[3] = w3;
+      }
+      for(; n >= 8; n -= 8, s += 8, d += 8)
+        *(uint64*)d = *(uint64*)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
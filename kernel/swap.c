@@ -0,0 +1,405 @@
+// Swapping of user pages to the swap area on the disk.
+//
+// mkfs reserves sb.nswap blocks after the file system, which
+// hold page-sized slots. A swapped-out page's PTE has PTE_V
+// clear, PTE_S set, its slot number in the PPN field, and its
+// other permission bits unchanged. vmfault() reads the page
+// back in, and fork shares slots by reference count.
+//
+// When a sleepable allocation of user memory finds no free
+// page, swapout() picks a victim with a clock (second-chance)
+// scan over the page tables of the current process and of
+// processes that are preempted in user space or pause()d:
+// a page whose PTE_A bit is set has the bit cleared and is
+// skipped; the first page found with PTE_A clear is written
+// to a free slot and freed. The working-set sampler in vm.c
+// clears PTE_A bits too, but first hands each set one to
+// swapref(), and the clock treats a page so marked as if its
+// PTE_A bit were still set. Megapages, the shared zero page,
+// and merged pages (see ksm.c) are never swapped out.
+//
+// Kernel code that copies to or from user memory while
+// holding a spinlock, and so cannot sleep to read a page in,
+// must call swapinrange() first.
+//
+// swap.lock serializes all swapping, so a page that is
+// being written out can't be read back in, or copied by
+// swapget(), until the write has finished.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+#include "vm.h"
+#include "vmstat.h"
+
+#define SLOTBLOCKS   (PGSIZE / BSIZE)        // disk blocks per slot
+#define NSWAPSLOT    (SWAPBLOCKS / SLOTBLOCKS)
+
+#define SLOT2PTE(s)  (((uint64)(s) << 10) | PTE_S)
+#define PTE2SLOT(pte) ((pte) >> 10)
+
+#define NREFPAGE     ((PHYSTOP - KERNBASE) / PGSIZE)
+#define REFIDX(pa)   (((pa) - KERNBASE) / PGSIZE)
+
+extern struct vmstat vmstats;
+extern char *zeropage;
+
+struct {
+  struct sleeplock lock;      // held while swapping a page in or out
+  struct buf buf;             // for disk I/O; protected by lock
+
+  struct spinlock maplock;    // protects the fields below
+  ushort ref[NSWAPSLOT];      // PTEs that refer to each slot; at
+                              // most one per process, so < NPROC
+  int nslot;                  // usable slots
+  int nused;
+  int next;                   // where to start looking for a free slot
+
+  uint dev;
+  uint start;                 // first block of the swap area
+
+  struct proc *hand;          // clock hand: next process to scan, or 0
+  uint64 handva;              // and next virtual address in it
+
+  // a bit per page of RAM: referenced since the hand last
+  // passed it, by the sampler's reckoning. set and cleared
+  // atomically, without a lock.
+  uint64 referenced[NREFPAGE / 64];
+} swap;
+
+// Called by fsinit() once the super block has been read.
+void
+swapinit(int dev, struct superblock *sb)
+{
+  initsleeplock(&swap.lock, "swap");
+  initlock(&swap.maplock, "swapmap");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / SLOTBLOCKS;
+  if(swap.nslot > NSWAPSLOT)
+    swap.nslot = NSWAPSLOT;
+}
+
+// Can the caller sleep, i.e. does it hold no spinlocks?
+static int
+cansleep(void)
+{
+  int n;
+
+  push_off();
+  n = mycpu()->noff;
+  pop_off();
+  return n == 1;
+}
+
+static int
+slotalloc(void)
+{
+  int s = -1;
+
+  acquire(&swap.maplock);
+  for(int i = 0; i < swap.nslot; i++){
+    int t = (swap.next + i) % swap.nslot;
+    if(swap.ref[t] == 0){
+      swap.ref[t] = 1;
+      swap.nused++;
+      swap.next = t + 1;
+      s = t;
+      break;
+    }
+  }
+  release(&swap.maplock);
+  return s;
+}
+
+static void
+slotput(int s)
+{
+  acquire(&swap.maplock);
+  if(s >= swap.nslot || swap.ref[s] == 0)
+    panic("slotput");
+  if(--swap.ref[s] == 0)
+    swap.nused--;
+  release(&swap.maplock);
+}
+
+// Another PTE is about to refer to the swapped-out page that
+// *pte refers to, if *pte still holds old: a thread sharing the
+// page table may be reading the page back in. swapin() changes
+// the PTE before it drops the slot's reference, so while *pte
+// holds old the slot is still in use. Used by uvmcopy().
+// Returns 0, or -1 if *pte has changed.
+int
+swapdup(pte_t *pte, pte_t old)
+{
+  int s = PTE2SLOT(old);
+
+  acquire(&swap.maplock);
+  if(*pte != old){
+    release(&swap.maplock);
+    return -1;
+  }
+  if(s >= swap.nslot || swap.ref[s] == 0 || swap.ref[s] >= NPROC)
+    panic("swapdup");
+  swap.ref[s]++;
+  release(&swap.maplock);
+  return 0;
+}
+
+// The swapped-out page pte is no longer mapped.
+// Used by uvmunmap(); doesn't sleep.
+void
+swapfree(pte_t pte)
+{
+  slotput(PTE2SLOT(pte));
+}
+
+// Read or write the page at pa from or to slot s.
+// Caller holds swap.lock.
+static void
+swapio(int s, char *pa, int write)
+{
+  struct buf *b = &swap.buf;
+
+  for(int i = 0; i < SLOTBLOCKS; i++){
+    b->dev = swap.dev;
+    b->blockno = swap.start + s*SLOTBLOCKS + i;
+    if(write)
+      memmove(b->data, pa + i*BSIZE, BSIZE);
+    virtio_disk_rw(b, write);
+    if(!write)
+      memmove(pa + i*BSIZE, b->data, BSIZE);
+  }
+}
+
+// May q's pages be swapped out now? Not if other threads
+// share them, which may be running with them in their TLBs.
+// Nor if q is sleeping without swapok set: futex.c relies on
+// this, since a process sleeping in futex_wait() is keyed by
+// the physical address of a word in one of its pages.
+// Caller holds q->lock.
+static int
+swappable(struct proc *q)
+{
+  if(q->pagetable == 0 || q->leader->nthread > 1)
+    return 0;
+  if(q == myproc())
+    return 1;
+  return q->swapok && (q->state == RUNNABLE || q->state == SLEEPING);
+}
+
+// The working-set sampler cleared the PTE_A bit of the user
+// page at pa; remember the reference for the clock hand.
+void
+swapref(uint64 pa)
+{
+  __sync_fetch_and_or(&swap.referenced[REFIDX(pa) / 64], 1UL << (REFIDX(pa) % 64));
+}
+
+// Was the page at pa referenced, by swapref(), since the hand
+// last asked? Clears the mark.
+static int
+swapreftest(uint64 pa)
+{
+  uint64 bit = 1UL << (REFIDX(pa) % 64);
+
+  return (__sync_fetch_and_and(&swap.referenced[REFIDX(pa) / 64], ~bit) & bit) != 0;
+}
+
+// Advance the clock hand through q's address space, giving
+// referenced pages a second chance, until a page with PTE_A
+// clear and no swapref() mark is found. Returns its PTE, or 0 at the end of q.
+// Caller holds q->lock.
+static pte_t*
+swapscan(struct proc *q)
+{
+  pte_t *pte;
+  int level, ref, cleared = 0;
+  uint64 va;
+
+  for(va = swap.handva; va < q->sz; va += PGSIZE){
+    if((pte = walklevel(q->pagetable, va, &level)) == 0){
+      // no page-table page here; skip to the next one.
+      va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+      continue;
+    if(level == 1){
+      va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if(PTE2PA(*pte) == (uint64)zeropage || (*pte & PTE_COW))
+      continue;
+    ref = swapreftest(PTE2PA(*pte));
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      cleared = 1;
+      continue;
+    }
+    if(ref)
+      continue;
+    break;
+  }
+  // so that the MMU sets PTE_A again on the next access.
+  if(cleared)
+    uvmflush(q, -1);
+  if(va >= q->sz)
+    return 0;
+  swap.handva = va + PGSIZE;
+  return pte;
+}
+
+// Write one cold user page to swap and free it.
+// Returns 0 on success, -1 if there was no page to swap
+// out or no free slot. Caller holds swap.lock.
+static int
+swapout_locked(void)
+{
+  struct proc *q;
+  pte_t *pte = 0;
+  uint64 pa;
+  int s, nproc = 0;
+
+  if((s = slotalloc()) < 0)
+    return -1;
+
+  for(q = procs; q; q = q->allnext)
+    nproc++;
+  // two trips around the clock, plus the rest of the current
+  // process: the first may only clear the PTE_A bits.
+  for(int n = 0; n < 2*nproc + 1 && pte == 0; n++){
+    if(swap.hand == 0)
+      swap.hand = procs;
+    q = swap.hand;
+    acquire(&q->lock);
+    if(swappable(q) && (pte = swapscan(q)) != 0){
+      // unmap the page before writing it, so that q
+      // can't change it in the meantime; if q faults on
+      // it, vmfault() waits for swap.lock.
+      pa = PTE2PA(*pte);
+      *pte = SLOT2PTE(s) | (PTE_FLAGS(*pte) & (PTE_R|PTE_W|PTE_X|PTE_U));
+      uvmflush(q, swap.handva - PGSIZE);
+    }
+    release(&q->lock);
+    if(pte == 0){
+      swap.hand = q->allnext;
+      swap.handva = 0;
+    }
+  }
+  if(pte == 0){
+    slotput(s);
+    return -1;
+  }
+
+  // q may exit and free the slot during the write; that's
+  // harmless, since only this function, which holds
+  // swap.lock, reuses slots.
+  swapio(s, (char*)pa, 1);
+  kfree((void*)pa);
+  __sync_fetch_and_add(&vmstats.swapout, 1);
+  return 0;
+}
+
+// Make room for a page of user memory by swapping one out.
+// Returns 0 on success, -1 if nothing could be swapped out
+// or the caller holds a spinlock and so cannot sleep.
+int
+swapout(void)
+{
+  int r;
+
+  if(swap.nslot == 0 || !cansleep())
+    return -1;
+  acquiresleep(&swap.lock);
+  r = swapout_locked();
+  releasesleep(&swap.lock);
+  return r;
+}
+
+// Read the swapped-out page at va back into memory.
+// Returns its physical address, or 0 if out of memory or
+// the caller holds a spinlock.
+uint64
+swapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(!cansleep())
+    return 0;
+  acquiresleep(&swap.lock);
+  // it may have been read in while we waited for the lock.
+  mem = (char*)walkaddr(pagetable, va);
+  if(mem == 0 && (pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_S)){
+    while((mem = kalloc()) == 0 && swapout_locked() == 0)
+      ;
+    if(mem){
+      int s = PTE2SLOT(*pte);
+
+      swapio(s, mem, 0);
+      // change the PTE first; see swapdup().
+      *pte = PA2PTE(mem) | PTE_FLAGS(*pte & ~PTE_S) | PTE_V | PTE_A;
+      __sync_synchronize();
+      slotput(s);
+      uvmflushpt(pagetable, va);
+      __sync_fetch_and_add(&vmstats.swapin, 1);
+    }
+  }
+  releasesleep(&swap.lock);
+  return (uint64)mem;
+}
+
+// Read in any swapped-out pages in [va, va+n), for a caller
+// that is about to copy to or from them holding a spinlock.
+// They stay resident until the process next sleeps or is
+// preempted with p->swapok set.
+void
+swapinrange(pagetable_t pagetable, uint64 va, uint64 n)
+{
+  pte_t *pte;
+  uint64 a;
+
+  if(swap.nslot == 0)
+    return;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) != 0 && (*pte & PTE_S))
+      swapin(pagetable, a);
+  }
+}
+
+// Copy the page at va to buf, whether it is in memory or
+// swapped out, without reading it back in.
+// Returns 0 if no page is mapped at va.
+int
+swapget(pagetable_t pagetable, uint64 va, char *buf)
+{
+  pte_t *pte;
+  uint64 pa;
+  int r = 1;
+
+  acquiresleep(&swap.lock);
+  if((pa = walkaddr(pagetable, va)) != 0)
+    memmove(buf, (char*)pa, PGSIZE);
+  else if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_S))
+    swapio(PTE2SLOT(*pte), buf, 0);
+  else
+    r = 0;
+  releasesleep(&swap.lock);
+  return r;
+}
+
+// Fill in the swap part of the vmstat counters.
+void
+swapstat(struct vmstat *st)
+{
+  st->swapslots = swap.nslot;
+  st->swapused = swap.nused;
+}
@@ -104,6 +104,20 @@ extern uint64 sys_close(void);
 extern uint64 sys_hello(void);
 extern uint64 sys_procinfo(void); 
 extern uint64 sys_checkpoint(void);
+extern uint64 sys_vmstat(void);
+extern uint64 sys_faultaround(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_ksm(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_quantum(void);
+extern uint64 sys_sched_setaffinity(void);
+extern uint64 sys_sched_getaffinity(void);
+extern uint64 sys_schedstat(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -133,6 +147,20 @@ static uint64 (*syscalls[])(void) = {
 [SYS_procinfo] sys_procinfo,
 [SYS_checkpoint] sys_checkpoint,
 [SYS_restore]    sys_restore,
+[SYS_vmstat]     sys_vmstat,
+[SYS_faultaround] sys_faultaround,
+[SYS_spawn]      sys_spawn,
+[SYS_ksm]        sys_ksm,
+[SYS_madvise]    sys_madvise,
+[SYS_setpriority] sys_setpriority,
+[SYS_quantum]    sys_quantum,
+[SYS_sched_setaffinity] sys_sched_setaffinity,
+[SYS_sched_getaffinity] sys_sched_getaffinity,
+[SYS_schedstat]  sys_schedstat,
+[SYS_clone]      sys_clone,
+[SYS_join]       sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
 };
 
 void
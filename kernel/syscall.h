@@ -23,4 +23,18 @@
 #define SYS_hello  22 
 #define SYS_procinfo  23 
 #define SYS_checkpoint 24
-#define SYS_restore    25
\ No newline at end of file
+#define SYS_restore    25
+#define SYS_vmstat     26
+#define SYS_faultaround 27
+#define SYS_spawn      28
+#define SYS_ksm        29
+#define SYS_madvise    30
+#define SYS_setpriority 31
+#define SYS_quantum    32
+#define SYS_sched_setaffinity 33
+#define SYS_sched_getaffinity 34
+#define SYS_schedstat  35
+#define SYS_clone      36
+#define SYS_join       37
+#define SYS_futex_wait 38
+#define SYS_futex_wake 39
@@ -25,7 +25,7 @@ argfd(int n, int *pfd, struct file **pf)
   struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE || (f=myproc()->leader->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -36,17 +36,16 @@ argfd(int n, int *pfd, struct file **pf)
 
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
+// The table is the process's leader's, shared by its threads.
 static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(__sync_bool_compare_and_swap(&p->ofile[fd], 0, f))
       return fd;
-    }
   }
   return -1;
 }
@@ -102,7 +101,9 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  // another thread may be closing it too.
+  if(!__sync_bool_compare_and_swap(&myproc()->leader->ofile[fd], f, 0))
+    return -1;
   fileclose(f);
   return 0;
 }
@@ -425,53 +426,89 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  iput(p->leader->cwd);
   end_op();
-  p->cwd = ip;
+  p->leader->cwd = ip;
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Copy the null-terminated user array of string pointers at
+// uargv into argv, one kalloc()ed page per string.
+// Returns 0, or -1 on error; either way the caller must
+// free argv with freeargv().
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
-      goto bad;
+    if(i >= MAXARG){
+      return -1;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
+      return -1;
     }
     if(uarg == 0){
       argv[i] = 0;
-      break;
+      return 0;
     }
     argv[i] = kalloc();
     if(argv[i] == 0)
-      goto bad;
+      return -1;
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
-      goto bad;
+      return -1;
   }
+}
 
-  int ret = kexec(path, argv);
-
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+static void
+freeargv(char **argv)
+{
+  for(int i = 0; i < MAXARG && argv[i] != 0; i++)
     kfree(argv[i]);
+}
 
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+  int ret = -1;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) == 0)
+    ret = kexec(path, argv);
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// spawn(path, argv, actions, nactions): start path in a new
+// process, without copying the caller's memory.
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnact act[MAXSPAWNACT];
+  uint64 uargv, uact;
+  int nact, ret = -1;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uact);
+  argint(3, &nact);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(nact < 0 || nact > MAXSPAWNACT)
+    return -1;
+  if(nact > 0 && copyin(myproc()->pagetable, (char*)act, uact, nact*sizeof(act[0])) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) == 0)
+    ret = kspawn(path, argv, act, nact);
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -480,7 +517,7 @@ sys_pipe(void)
   uint64 fdarray; // user pointer to array of two integers
   struct file *rf, *wf;
   int fd0, fd1;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
   argaddr(0, &fdarray);
   if(pipealloc(&rf, &wf) < 0)
@@ -6,6 +6,8 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "vm.h"
+#include "vmstat.h"
+#include "sched.h"
 #include "stat.h"
 #include "kernel/fs.h"
 #include "kernel/sleeplock.h"
@@ -45,6 +47,48 @@ sys_wait(void)
   return kwait(p);
 }
 
+// clone(fn, stack, arg): see kclone().
+uint64
+sys_clone(void)
+{
+  uint64 fn, stack, arg;
+
+  argaddr(0, &fn);
+  argaddr(1, &stack);
+  argaddr(2, &arg);
+  return kclone(fn, stack, arg);
+}
+
+uint64
+sys_join(void)
+{
+  return kjoin();
+}
+
+// futex_wait(addr, val): see futexwait().
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return futexwait(addr, val);
+}
+
+// futex_wake(addr, n): see futexwake().
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futexwake(addr, n);
+}
+
 uint64
 sys_sbrk(void)
 {
@@ -56,18 +100,9 @@ sys_sbrk(void)
   argint(1, &t);
   addr = myproc()->sz;
 
-  if(t == SBRK_EAGER || n < 0) {
-    if(growproc(n) < 0) {
-      return -1;
-    }
-  } else {
-    // Lazily allocate memory
-    if(addr + n < addr)
-      return -1;
-    if(addr + n > TRAPFRAME)
-      return -1;
-    myproc()->sz += n;
-  }
+  // lazily allocated memory is faulted in by vmfault().
+  if(growproc(n, t != SBRK_EAGER) < 0)
+    return -1;
   return addr;
 }
 
@@ -82,13 +117,16 @@ sys_pause(void)
     n = 0;
   acquire(&tickslock);
   ticks0 = ticks;
+  myproc()->swapok = 1;
   while(ticks - ticks0 < n){
     if(killed(myproc())){
+      myproc()->swapok = 0;
       release(&tickslock);
       return -1;
     }
     sleep(&ticks, &tickslock);
   }
+  myproc()->swapok = 0;
   release(&tickslock);
   return 0;
 }
@@ -120,44 +158,118 @@ sys_hello(void)
   return 0;
 }
 
+// proc_info entries copied out at a time: as many as fit in
+// the largest kmalloc() buffer.
+#define PIBATCH (KMALLOC_MAX / sizeof(struct proc_info))
+
+// procinfo(info, max): fill in info[] for up to max processes.
+// Returns the number filled in, or -1.
 uint64
 sys_procinfo(void)
 {
   uint64 user_ptr; 
   int num_procs = 0;
+  int n = 0;
+  int max;
 
   argaddr(0, &user_ptr);
+  argint(1, &max);
 
-  struct proc_info *kernel_buf = (struct proc_info *)kalloc();
+  struct proc_info *kernel_buf = kmalloc(PIBATCH * sizeof(struct proc_info));
   if(kernel_buf == 0) {
     return -1;
   }
-  
-  // printf("kernel: kalloc() allocated a page for procinfo\n");
 
   struct proc *p;
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(p = procs; p && num_procs + n < max; p = p->allnext) {
     acquire(&p->lock);
     if(p->state != UNUSED) {
-      kernel_buf[num_procs].pid = p->pid;
-      kernel_buf[num_procs].state = p->state;
-      safestrcpy(kernel_buf[num_procs].name, p->name, sizeof(p->name));
-      num_procs++;
+      kernel_buf[n].pid = p->pid;
+      kernel_buf[n].state = p->state;
+      safestrcpy(kernel_buf[n].name, p->name, sizeof(p->name));
+      // threads share the leader's working set.
+      kernel_buf[n].rss = p->leader->rss;
+      kernel_buf[n].wss = p->leader->wss;
+      kernel_buf[n].dirty = p->leader->wsdirty;
+      kernel_buf[n].priority = p->priority;
+      kernel_buf[n].utime = p->utime / TICKTIME;
+      kernel_buf[n].stime = p->stime / TICKTIME;
+      kernel_buf[n].cpu = p->cpu;
+      kernel_buf[n].affinity = p->affinity;
+      kernel_buf[n].migrations = p->nmigrate;
+      n++;
     }
     release(&p->lock);
-  }
 
-  if(copyout(myproc()->pagetable, user_ptr, (char *)kernel_buf, num_procs * sizeof(struct proc_info)) != 0) {
-    kfree((void *)kernel_buf);
-    return -1;
+    if(n == PIBATCH || ((p->allnext == 0 || num_procs + n == max) && n > 0)) {
+      uint64 dst = user_ptr + num_procs * sizeof(struct proc_info);
+      if(copyout(myproc()->pagetable, dst, (char *)kernel_buf, n * sizeof(struct proc_info)) != 0) {
+        kmfree(kernel_buf);
+        return -1;
+      }
+      num_procs += n;
+      n = 0;
+    }
   }
-  
-  // printf("kernel: freeing page used by procinfo\n");
-  kfree((void *)kernel_buf);
+
+  kmfree(kernel_buf);
 
   return num_procs;
 }
 
+uint64
+sys_vmstat(void)
+{
+  uint64 addr;
+  struct vmstat st;
+
+  argaddr(0, &addr);
+  vmstat_get(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// Set the calling process's fault-around limit to n pages
+// (0 disables it); n < 0 just queries. Returns the old limit.
+uint64
+sys_faultaround(void)
+{
+  int n, old;
+  struct proc *p = myproc();
+
+  argint(0, &n);
+  old = p->faultaround;
+  if(n >= 0)
+    p->faultaround = n > MAXFAULTAROUND ? MAXFAULTAROUND : n;
+  return old;
+}
+
+// madvise(addr, len, advice): see MADV_* in vm.h.
+uint64
+sys_madvise(void)
+{
+  uint64 addr;
+  int len, advice;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &advice);
+  if(len < 0)
+    return -1;
+  return uvmadvise(myproc(), addr, len, advice);
+}
+
+// Turn same-page merging on (1) or off (0); -1 just queries.
+// Returns the old setting.
+uint64
+sys_ksm(void)
+{
+  int on;
+
+  argint(0, &on);
+  return ksmctl(on);
+}
 
 // =================================================================
 // CHECKPOINT & RESTORE (implemented in proc.c + vm.c)
@@ -186,3 +298,89 @@ sys_restore(void)
 
   return proc_restore(path);
 }
+
+// setpriority(pid, prio): see ksetpriority().
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  argint(0, &pid);
+  argint(1, &prio);
+  return ksetpriority(pid, prio);
+}
+
+// quantum(ms, tickless): set the scheduling quantum to ms
+// milliseconds, from 1 to 100, if ms > 0, and turn tickless
+// idle on or off if tickless >= 0. Returns the old quantum
+// in milliseconds, or -1 if ms is out of range.
+uint64
+sys_quantum(void)
+{
+  int ms, tl, old;
+
+  argint(0, &ms);
+  argint(1, &tl);
+  old = quantum / (TIMEFREQ / 1000);
+  if(ms > 100)
+    return -1;
+  if(ms > 0)
+    quantum = (uint64)ms * (TIMEFREQ / 1000);
+  if(tl >= 0)
+    tickless = tl != 0;
+  return old;
+}
+
+// sched_setaffinity(pid, mask): see ksetaffinity().
+uint64
+sys_sched_setaffinity(void)
+{
+  int pid;
+  uint64 mask;
+
+  argint(0, &pid);
+  argaddr(1, &mask);
+  return ksetaffinity(pid, mask);
+}
+
+// schedstat(pid, st): copy process pid's scheduler latency
+// histograms to *st, or if pid is -1, each CPU's to st[0] to
+// st[NCPU-1]. Returns 0, or -1 if there is no such process.
+uint64
+sys_schedstat(void)
+{
+  struct schedstat st;
+  uint64 addr;
+  int pid;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  if(pid != -1){
+    if(pid <= 0 || kschedstat(pid, 0, &st) < 0)
+      return -1;
+    return copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st));
+  }
+  for(int i = 0; i < NCPU; i++){
+    kschedstat(0, i, &st);
+    if(copyout(myproc()->pagetable, addr + i*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// sched_getaffinity(pid): returns pid's CPU mask, or -1 if
+// there is no such process.
+uint64
+sys_sched_getaffinity(void)
+{
+  struct proc *p;
+  uint64 mask;
+  int pid;
+
+  argint(0, &pid);
+  if((p = findproc(pid)) == 0)
+    return -1;
+  mask = p->affinity;
+  release(&p->lock);
+  return mask;
+}
@@ -7,7 +7,15 @@
 #include "defs.h"
 
 struct spinlock tickslock;
-uint ticks;
+uint ticks;                   // TICKTIME units of r_time() since boot
+static uint64 tickbase;       // r_time() / TICKTIME at boot
+
+// timer interrupt interval for a CPU that is running a
+// process, in r_time() units; see quantum().
+uint64 quantum = TICKTIME;
+
+// if set, idle CPUs other than CPU 0 don't take timer interrupts.
+int tickless = 1;
 
 extern char trampoline[], uservec[];
 
@@ -20,6 +28,7 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  tickbase = r_time() / TICKTIME;
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -27,6 +36,10 @@ void
 trapinithart(void)
 {
   w_stvec((uint64)kernelvec);
+
+  // let user programs read the cycle and time counters,
+  // for benchmarks such as membench.
+  w_scounteren(r_scounteren() | 3);
 }
 
 //
@@ -80,14 +93,22 @@ usertrap(void)
   if(killed(p))
     kexit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
-    yield();
+  // on a timer interrupt, take a working-set sample if one
+  // is due, and give up the CPU if the scheduler says so.
+  // until the process runs again, its pages may be swapped out.
+  if(which_dev == 2){
+    wsself();
+    if(schedtick(p, 1)){
+      p->swapok = 1;
+      yield();
+      p->swapok = 0;
+    }
+  }
 
   prepare_return();
 
-  // the user page table to switch to, for trampoline.S
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // the user page table and ASID to switch to, for trampoline.S
+  uint64 satp = uvmswitch(p);
 
   // return to trampoline.S; satp value in a0.
   return satp;
@@ -110,6 +131,9 @@ prepare_return(void)
   uint64 trampoline_uservec = TRAMPOLINE + (uservec - trampoline);
   w_stvec(trampoline_uservec);
 
+  // where uservec and userret find the trapframe.
+  w_sscratch(p->tfva);
+
   // set up trapframe values that uservec will need when
   // the process next traps into the kernel.
   p->trapframe->kernel_satp = r_satp();         // kernel page table
@@ -151,8 +175,9 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0)
+  // give up the CPU if this is a timer interrupt and the
+  // scheduler says so.
+  if(which_dev == 2 && myproc() != 0 && schedtick(myproc(), 0))
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -164,17 +189,40 @@ kerneltrap()
 void
 clockintr()
 {
-  if(cpuid() == 0){
+  uint64 now = r_time();
+  uint t;
+
+  // ticks follows r_time(), whatever the quantum; CPU 0 does
+  // the once-a-tick work for each tick that has passed, up to
+  // a few, since it last looked.
+  if(cpuid() == 0 && (t = now / TICKTIME - tickbase) != ticks){
+    int n = t - ticks;
     acquire(&tickslock);
-    ticks++;
+    ticks = t;
     wakeup(&ticks);
     release(&tickslock);
+    for(int i = 0; i < n && i < 4; i++){
+      wstick();
+      ksmtick();
+      schedclock();
+    }
   }
 
   // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+  // the interrupt request. a CPU that is running a process
+  // is interrupted once a quantum; an idle CPU 0 only at
+  // the next tick.
+  if(cpuid() == 0 && mycpu()->proc == 0)
+    w_stimecmp((now / TICKTIME + 1) * TICKTIME);
+  else
+    w_stimecmp(now + quantum);
+}
+
+// Interrupt CPU cpu, to wake it from wfi.
+void
+ipi(int cpu)
+{
+  *(volatile uint32 *)CLINT_MSIP(cpu) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -212,6 +260,11 @@ devintr()
     // timer interrupt.
     clockintr();
     return 2;
+  } else if(scause == 0x8000000000000001L){
+    // software interrupt: an IPI from another CPU, passed
+    // on by ipivec in kernelvec.S. it only wakes the CPU.
+    w_sip(r_sip() & ~2);
+    return 1;
   } else {
     return 0;
   }
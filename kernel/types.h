@@ -13,5 +13,26 @@ struct proc_info {
   int pid;         // Process ID
   int state;       // Process state
   char name[16];   // Process name
+  int rss;         // Resident pages
+  int wss;         // Working set: recently referenced pages
+  int dirty;       // Recently written pages
+  int priority;    // Scheduler level, 0 highest
+  uint64 utime;    // Clock ticks spent in user mode
+  uint64 stime;    // Clock ticks spent in the kernel
+  int cpu;         // CPU that last ran it, or -1
+  uint64 affinity; // CPUs it may run on, one bit each
+  uint64 migrations; // Times it moved to another CPU
+};
+
+// A file-descriptor action for spawn(). The actions are
+// applied in order to the new process's copy of the
+// caller's open files.
+#define SPAWN_DUP2  1    // make newfd refer to fd's file
+#define SPAWN_CLOSE 2    // close fd
+
+struct spawnact {
+  int op;
+  int fd;
+  int newfd;
 };
 
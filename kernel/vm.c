@@ -7,16 +7,28 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "fs.h"
+#include "vm.h"
+#include "vmstat.h"
 
 /*
  * the kernel's page table.
  */
 pagetable_t kernel_pagetable;
 
+// system-wide VM counters; updated atomically since
+// every hart takes page faults.
+struct vmstat vmstats;
+
+// a page of zeros, mapped read-only wherever a process
+// reads lazily allocated memory it has never written.
+char *zeropage;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static void vmfaultaround(struct proc*, uint64, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -35,19 +47,23 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
 
+  // CLINT software-interrupt registers, for IPIs.
+  kvmmap(kpgtbl, CLINT, CLINT, PGSIZE, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses megapages once the range is 2 MB-aligned.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
-  
+  // kernel stacks are mapped by allocproc() as processes
+  // are created.
+
   return kpgtbl;
 }
 
@@ -66,6 +82,10 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+
+  if((zeropage = kalloc()) == 0)
+    panic("kvminit: zeropage");
+  memset(zeropage, 0, PGSIZE);
 }
 
 // Switch the current CPU's h/w page table register to
@@ -76,15 +96,139 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Address-space IDs. Each process's satp carries an ASID, so the
+// TLB can hold its entries alongside the kernel's (ASID 0) and
+// other processes', and traps and context switches need not flush
+// it. ASIDs are handed out in order; when they run out, a new
+// generation begins, each process gets a new ASID the next time
+// it returns to user space, and each CPU flushes its whole TLB
+// once before it uses an ASID of the new generation.
+//
+// Whoever changes a user PTE calls uvmflush(). If the process
+// is the current one, on the CPU where it last ran in user
+// space, only the changed page is flushed. Otherwise
+// p->tlbflush is set, and uvmswitch() flushes the process's
+// ASID before it next returns to user space; it does so too
+// when a process moves to another CPU, whose TLB may hold
+// entries from when the process last ran there.
+//
+// The threads of a process share its leader's ASID, since they
+// share its page table: a flush by one thread also covers the
+// others' entries on that CPU, though not on other CPUs.
+//
+// Without ASIDs every process runs with ASID 0, like the
+// kernel, and the whole TLB is flushed on every trap.
+struct {
+  struct spinlock lock;
+  uint64 gen;                 // current generation, from 1
+  uint64 next;                // next ASID to hand out
+  uint64 nasid;               // ASIDs the MMU implements; 0 if none
+} asids;
+
+// Find out how many ASID bits the MMU implements: the field
+// is WARL, so unimplemented bits read back as zero.
+// Called by hart 0 once paging is on.
+void
+asidinit(void)
+{
+  uint64 mask;
+
+  initlock(&asids.lock, "asid");
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASID_MASK));
+  mask = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
+  sfence_vma();
+  asids.nasid = mask ? mask + 1 : 0;
+  asids.gen = 1;
+  asids.next = 1;
+}
+
+// Get this CPU's TLB ready for p to return to user space, and
+// return the satp value that selects p's page table and ASID.
+// Called with interrupts off.
+uint64
+uvmswitch(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  struct proc *g = p->leader;
+  int id = cpuid();
+  int flushall = 0;
+
+  if(asids.nasid == 0){
+    // every process shares ASID 0 with the kernel.
+    p->trapframe->tlbflush = 1;
+    sfence_vma();
+    return MAKE_SATP(p->pagetable, 0);
+  }
+  p->trapframe->tlbflush = 0;
+
+  acquire(&asids.lock);
+  if(g->asidgen != asids.gen){
+    if(asids.next == asids.nasid){
+      asids.gen++;
+      asids.next = 1;
+    }
+    g->asid = asids.next++;
+    g->asidgen = asids.gen;
+  }
+  if(c->asidgen != asids.gen){
+    c->asidgen = asids.gen;
+    flushall = 1;
+  }
+  release(&asids.lock);
+
+  if(flushall)
+    sfence_vma();
+  else if(p->lastcpu != id || p->tlbflush)
+    sfence_vma_asid(g->asid);
+  p->lastcpu = id;
+  p->tlbflush = 0;
+
+  return MAKE_SATP(p->pagetable, g->asid);
+}
+
+// p's PTE for va (or, if va is -1, many of its PTEs) changed.
+// If p is the current process and last ran in user space on
+// this CPU, flush the stale entries now; otherwise they are
+// flushed before p next returns to user space. The flush is
+// needed even when an invalid PTE becomes valid, since the
+// MMU might otherwise not see the new PTE yet, and fault.
+void
+uvmflush(struct proc *p, uint64 va)
+{
+  push_off();
+  if(p != myproc() || p->lastcpu != cpuid())
+    p->tlbflush = 1;
+  else if(va == -1)
+    sfence_vma_asid(p->leader->asid);
+  else
+    sfence_vma_page(va, p->leader->asid);
+  pop_off();
+}
+
+// A PTE for va in pagetable changed; flush it if pagetable
+// is the current process's.
+void
+uvmflushpt(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    uvmflush(p, va);
+}
+
 // Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// that corresponds to virtual address va, descending no
+// further than level stop.  If alloc!=0, create any required
+// page-table pages.  If a leaf (megapage) PTE is found above
+// stop, return it instead.  If level!=0, *level is set to the
+// level of the returned PTE.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -94,24 +238,54 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
-pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+static pte_t *
+walkpte(pagetable_t pagetable, uint64 va, int alloc, int stop, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > stop; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        if(l == 2)
+          panic("walk: gigapage");
+        if(level)
+          *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
-      *pte = PA2PTE(pagetable) | PTE_V;
+      // another thread sharing the page table may get there
+      // first; if so, use its page.
+      if(!__sync_bool_compare_and_swap(pte, 0, PA2PTE(pagetable) | PTE_V)){
+        kfree(pagetable);
+        pagetable = (pagetable_t)PTE2PA(*pte);
+      }
     }
   }
-  return &pagetable[PX(0, va)];
+  if(level)
+    *level = stop;
+  return &pagetable[PX(stop, va)];
+}
+
+// Return the address of the leaf PTE that maps va, which
+// is either a level-0 PTE or a level-1 megapage PTE.
+// If alloc!=0, create any required page-table pages.
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walkpte(pagetable, va, alloc, 0, 0);
+}
+
+// Like walk(pagetable, va, 0), but also report in *level
+// whether the returned PTE is a 4 KB (0) or 2 MB (1) leaf.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int *level)
+{
+  return walkpte(pagetable, va, 0, 0, level);
 }
 
 // Look up a virtual address, return the physical address,
@@ -122,11 +296,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -134,12 +309,84 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(level == 1)
+    pa += PGROUNDDOWN(va) & (SUPERPGSIZE - 1);
   return pa;
 }
 
+#define PTBATCH 32      // pages allocated per kalloc_batch() call
+
+// Allocate, with as few kalloc_batch() calls as possible, all
+// the page-table pages that walk(pagetable, a, 1) would for
+// each a in [va, va+size). If mega is set, 2 MB regions that
+// lie wholly inside the range get no level-0 page, since the
+// caller will map them with megapages.
+// Returns 0 on success, -1 if out of memory; the page-table
+// pages allocated before that stay in place.
+static int
+walkrange(pagetable_t pagetable, uint64 va, uint64 size, int mega)
+{
+  void *pool[PTBATCH];
+  uint64 a, start, end, gb = -1;
+  pagetable_t pt;
+  pte_t *pte;
+  int need = 0, n = 0, used = 0, l, stop;
+
+  start = SUPERPGROUNDDOWN(va);
+  end = va + size;
+  if(end > MAXVA)
+    panic("walkrange");
+
+  // count the missing level-1 and level-0 page-table pages.
+  for(a = start; a < end; a += SUPERPGSIZE){
+    stop = mega && a >= va && a + SUPERPGSIZE <= end;
+    pte = &pagetable[PX(2, a)];
+    if((*pte & PTE_V) == 0){
+      if(PX(2, a) != gb)
+        need++;
+      gb = PX(2, a);
+      need += !stop;
+    } else if(!PTE_LEAF(*pte) && !stop){
+      pt = (pagetable_t)PTE2PA(*pte);
+      if((pt[PX(1, a)] & PTE_V) == 0)
+        need++;
+    }
+  }
+
+  for(a = start; a < end && need + n - used > 0; a += SUPERPGSIZE){
+    stop = mega && a >= va && a + SUPERPGSIZE <= end;
+    pt = pagetable;
+    for(l = 2; l > stop; l--){
+      pte = &pt[PX(l, a)];
+      if((*pte & PTE_V) == 0){
+        if(used == n){
+          n = kalloc_batch(pool, need < PTBATCH ? need : PTBATCH, 1);
+          need -= n;
+          used = 0;
+          if(n == 0)
+            return -1;
+        }
+        // a thread sharing the page table may get there first.
+        if(__sync_bool_compare_and_swap(pte, 0, PA2PTE(pool[used]) | PTE_V))
+          used++;
+      } else if(PTE_LEAF(*pte)){
+        break;
+      }
+      pt = (pagetable_t)PTE2PA(*pte);
+    }
+  }
+  while(used < n)
+    kfree(pool[used++]);
+  return 0;
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
 // va and size MUST be page-aligned.
+// Wherever va and pa are both 2 MB-aligned and at least 2 MB
+// remain, a single level-1 megapage PTE is used.
+// The page-table pages for a range of more than one page are
+// allocated up front by walkrange().
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
@@ -156,15 +403,38 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 
   if(size == 0)
     panic("mappages: size");
+
+  if(size > PGSIZE &&
+     walkrange(pagetable, va, size, (va - pa) % SUPERPGSIZE == 0) != 0)
+    return -1;
   
   a = va;
   last = va + size - PGSIZE;
   for(;;){
+    if((a % SUPERPGSIZE) == 0 && (pa % SUPERPGSIZE) == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      if((pte = walkpte(pagetable, a, 1, 1, 0)) == 0)
+        return -1;
+      if((*pte & PTE_V) && PTE_LEAF(*pte))
+        panic("mappages: remap");
+      if((*pte & PTE_V) == 0){
+        *pte = PA2PTE(pa) | perm | PTE_V;
+        uvmflushpt(pagetable, a);
+        if(a + SUPERPGSIZE - PGSIZE == last)
+          break;
+        a += SUPERPGSIZE;
+        pa += SUPERPGSIZE;
+        continue;
+      }
+      // a page-table page already covers this 2 MB;
+      // fill it with 4 KB mappings instead.
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
-    if(*pte & PTE_V)
+    if(*pte & (PTE_V|PTE_S))
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
+    uvmflushpt(pagetable, a);
     if(a == last)
       break;
     a += PGSIZE;
@@ -173,76 +443,196 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Demote the megapage mapping that contains va to 512 4 KB
+// mappings of the same physical memory, with the same
+// permissions. Does nothing if va isn't mapped by a megapage.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t l0;
+  uint64 pa;
+  int level, flags;
+
+  pte = walklevel(pagetable, va, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level != 1)
+    return 0;
+  if((l0 = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for(int i = 0; i < 512; i++)
+    l0[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(l0) | PTE_V;
+  uvmflushpt(pagetable, va);
+  __sync_fetch_and_add(&vmstats.megasplits, 1);
+  return 0;
+}
+
+// Split the megapages that [va, end) only partly covers, so
+// that it can be unmapped a page at a time.
+// Returns 0 on success, -1 if out of memory.
+static int
+uvmsplitends(pagetable_t pagetable, uint64 va, uint64 end)
+{
+  if((va % SUPERPGSIZE) != 0 && uvmsplit(pagetable, va) != 0)
+    return -1;
+  if((end % SUPERPGSIZE) != 0 && uvmsplit(pagetable, end - PGSIZE) != 0)
+    return -1;
+  return 0;
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
-  pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
-  if(pagetable == 0)
-    return 0;
-  memset(pagetable, 0, PGSIZE);
-  return pagetable;
+  return (pagetable_t) kalloc_zeroed();
 }
 
 // Remove npages of mappings starting from va. va must be
 // page-aligned. It's OK if the mappings don't exist.
+// A megapage that is only partly unmapped is first split.
 // Optionally free the physical memory.
-void
+// Returns 0, or -1 if out of memory to split a megapage, in
+// which case nothing has been unmapped.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0) // leaf page table entry allocated?
+  end = va + npages*PGSIZE;
+  if(uvmsplitends(pagetable, va, end) != 0)
+    return -1;
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walklevel(pagetable, a, &level)) == 0) // leaf page table entry allocated?
       continue;   
-    if((*pte & PTE_V) == 0)  // has physical page been allocated?
+    if((*pte & PTE_V) == 0){  // has physical page been allocated?
+      if(*pte & PTE_S){
+        if(do_free)
+          swapfree(*pte);
+        *pte = 0;
+      }
       continue;
+    }
+    if(level == 1){
+      if((a % SUPERPGSIZE) == 0 && a + SUPERPGSIZE <= end){
+        if(do_free)
+          kfree_pages((void*)PTE2PA(*pte), SUPERPGORDER);
+        *pte = 0;
+        uvmflushpt(pagetable, a);
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      // uvmsplitends() split the partly covered ones.
+      panic("uvmunmap: megapage");
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      if(*pte & PTE_COW)
+        ksmput(pa);
+      else if(pa != (uint64)zeropage)
+        kfree((void*)pa);
     }
     *pte = 0;
+    uvmflushpt(pagetable, a);
   }
+  return 0;
+}
+
+// Allocate a zeroed page of user memory. If memory is short,
+// swap out cold user pages to make room, if the caller can sleep.
+static char *
+uvmkalloc(void)
+{
+  char *mem;
+
+  while((mem = kalloc_zeroed()) == 0 && swapout() == 0)
+    ;
+  return mem;
+}
+
+// Like walk(pagetable, va, 1), but swap out cold user pages
+// to make room for page-table pages if memory is short.
+static pte_t *
+uvmwalk(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  while((pte = walk(pagetable, va, 1)) == 0 && swapout() == 0)
+    ;
+  return pte;
 }
 
 // Allocate PTEs and physical memory to grow a process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// The page-table pages, and the 4 KB pages of each 2 MB region,
+// are allocated in batches.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
+  void *batch[PTBATCH];
   char *mem;
-  uint64 a;
+  uint64 a, n;
+  int nbatch = 0, used = 0;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
+  // if this fails, uvmwalk() below swaps to make room.
+  if(newsz > oldsz)
+    walkrange(pagetable, oldsz, newsz - oldsz, 1);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
-    if(mem == 0){
-      uvmdealloc(pagetable, a, oldsz);
-      return 0;
+    if((a % SUPERPGSIZE) == 0 && a + SUPERPGSIZE <= newsz &&
+       (mem = kalloc_pages(SUPERPGORDER)) != 0){
+      memset(mem, 0, SUPERPGSIZE);
+      if(mappages(pagetable, a, SUPERPGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+        kfree_pages(mem, SUPERPGORDER);
+        goto bad;
+      }
+      __sync_fetch_and_add(&vmstats.megapages, 1);
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if(used == nbatch){
+      // the pages left in this 2 MB region, at most PTBATCH.
+      n = SUPERPGROUNDDOWN(a) + SUPERPGSIZE;
+      if(n > newsz)
+        n = newsz;
+      n = PGROUNDUP(n - a) / PGSIZE;
+      nbatch = kalloc_batch(batch, n < PTBATCH ? n : PTBATCH, 1);
+      used = 0;
     }
-    memset(mem, 0, PGSIZE);
+    if(uvmwalk(pagetable, a) == 0)
+      goto bad;
+    if((mem = used < nbatch ? batch[used++] : uvmkalloc()) == 0)
+      goto bad;
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
-      uvmdealloc(pagetable, a, oldsz);
-      return 0;
+      goto bad;
     }
   }
   return newsz;
+
+ bad:
+  while(used < nbatch)
+    kfree(batch[used++]);
+  uvmdealloc(pagetable, a, oldsz);
+  return 0;
 }
 
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, which is oldsz
+// if there was no memory to split a megapage at newsz.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -251,7 +641,8 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) != 0)
+      return oldsz;
   }
 
   return newsz;
@@ -296,18 +687,62 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  pte_t *pte, *npte, opte;
   uint64 pa, i;
   uint flags;
   char *mem;
+  int level;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
+    if((pte = walklevel(old, i, &level)) == 0)
       continue;   // page table entry hasn't been allocated
-    if((*pte & PTE_V) == 0)
+    // another thread of the parent may change the PTE, for
+    // example by reading the page back in from swap; look at
+    // it only once.
+  again:
+    opte = *pte;
+    if((opte & PTE_V) == 0){
+      if(opte & PTE_S){
+        // share the swap slot; each process reads in
+        // its own copy when it touches the page.
+        if((npte = walk(new, i, 1)) == 0)
+          goto err;
+        if(swapdup(pte, opte) != 0)
+          goto again;    // read in meanwhile
+        *npte = opte;
+      }
       continue;   // physical page hasn't been allocated
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
+    }
+    pa = PTE2PA(opte);
+    flags = PTE_FLAGS(opte);
+    if(level == 1){
+      if((i % SUPERPGSIZE) == 0 && i + SUPERPGSIZE <= sz &&
+         (mem = kalloc_pages(SUPERPGORDER)) != 0){
+        memmove(mem, (char*)pa, SUPERPGSIZE);
+        if(mappages(new, i, SUPERPGSIZE, (uint64)mem, flags) != 0){
+          kfree_pages(mem, SUPERPGORDER);
+          goto err;
+        }
+        __sync_fetch_and_add(&vmstats.megapages, 1);
+        i += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      // no megapage free; copy this one 4 KB at a time.
+      pa += i & (SUPERPGSIZE - 1);
+    }
+    if(pa == (uint64)zeropage){
+      // share the zero page rather than copying it.
+      if(mappages(new, i, PGSIZE, pa, flags) != 0)
+        goto err;
+      continue;
+    }
+    if(flags & PTE_COW){
+      // and merged pages too.
+      if(mappages(new, i, PGSIZE, pa, flags) != 0)
+        goto err;
+      ksmdup(pa);
+      continue;
+    }
     if((mem = kalloc()) == 0)
       goto err;
     memmove(mem, (char*)pa, PGSIZE);
@@ -325,15 +760,65 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
-void
+// returns 0, or -1 if out of memory to split a megapage.
+int
 uvmclear(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   
+  if(uvmsplit(pagetable, va) != 0)
+    return -1;
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
+  uvmflushpt(pagetable, va);
+  return 0;
+}
+
+// Translate user address va for a copy of up to len bytes to
+// (write=1) or from (write=0) user memory, faulting the page in
+// if it is lazily allocated, swapped out, or copy-on-write.
+// Returns the physical address, and sets *np to the number of
+// bytes from va, at most len, that are accessible and physically
+// contiguous: the rest of a megapage, or a run of pages whose
+// PTEs, read straight from the same page-table page, map adjacent
+// physical pages. The caller can move them with one memmove().
+// Returns 0 if va isn't accessible.
+static uint64
+uvmspan(pagetable_t pagetable, uint64 va, uint64 len, int write, uint64 *np)
+{
+  uint64 need = PTE_V | PTE_U | (write ? PTE_W : 0);
+  uint64 pa, n;
+  pte_t *pte;
+  int level;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walklevel(pagetable, va, &level);
+  if(pte == 0 || (*pte & need) != need){
+    if(vmfault(pagetable, va, !write) == 0)
+      return 0;
+    pte = walklevel(pagetable, va, &level);
+    if(pte == 0 || (*pte & need) != need)
+      return 0;
+  }
+
+  if(level == 1){
+    pa = PTE2PA(*pte) + (va & (SUPERPGSIZE - 1));
+    n = SUPERPGSIZE - (va & (SUPERPGSIZE - 1));
+  } else {
+    pa = PTE2PA(*pte) + (va & (PGSIZE - 1));
+    n = PGSIZE - (va & (PGSIZE - 1));
+    for(int i = PX(0, va) + 1; i < 512 && n < len; i++){
+      pte++;
+      if((*pte & need) != need || PTE2PA(*pte) != pa + n)
+        break;
+      n += PGSIZE;
+    }
+  }
+  *np = n < len ? n : len;
+  return pa;
 }
 
 // Copy from kernel to user.
@@ -342,34 +827,16 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
-  pte_t *pte;
+  uint64 n, pa;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
-      return -1;
-  
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
-      }
-    }
-
-    pte = walk(pagetable, va0, 0);
-    // forbid copyout over read-only user text pages.
-    if((*pte & PTE_W) == 0)
+    if((pa = uvmspan(pagetable, dstva, len, 1, &n)) == 0)
       return -1;
-      
-    n = PGSIZE - (dstva - va0);
-    if(n > len)
-      n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)pa, src, n);
 
     len -= n;
     src += n;
-    dstva = va0 + PGSIZE;
+    dstva += n;
   }
   return 0;
 }
@@ -380,98 +847,494 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-        return -1;
-      }
-    }
-    n = PGSIZE - (srcva - va0);
-    if(n > len)
-      n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    if((pa = uvmspan(pagetable, srcva, len, 0, &n)) == 0)
+      return -1;
+    memmove(dst, (void *)pa, n);
 
     len -= n;
     dst += n;
-    srcva = va0 + PGSIZE;
+    srcva += n;
   }
   return 0;
 }
 
+// does the 64-bit word w contain a zero byte?
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
+// Aligned words that contain no '\0' are copied whole.
 // Return 0 on success, -1 on error.
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  uint64 n, pa, w;
+  char *p;
 
-  while(got_null == 0 && max > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+  while(max > 0){
+    if((pa = uvmspan(pagetable, srcva, max, 0, &n)) == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
-    if(n > max)
-      n = max;
+    srcva += n;
+    max -= n;
 
-    char *p = (char *) (pa0 + (srcva - va0));
+    p = (char *) pa;
     while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
+      if(((uint64)p & 7) == 0 && n >= 8){
+        w = *(uint64*)p;
+        if(!HASZERO(w)){
+          if(((uint64)dst & 7) == 0)
+            *(uint64*)dst = w;
+          else
+            memmove(dst, &w, 8);
+          p += 8;
+          dst += 8;
+          n -= 8;
+          continue;
+        }
       }
+      if((*dst = *p) == '\0')
+        return 0;
       --n;
-      --max;
       p++;
       dst++;
     }
-
-    srcva = va0 + PGSIZE;
   }
-  if(got_null){
-    return 0;
-  } else {
+  return -1;
+}
+
+// Map the page at pa at va in pagetable, if nothing is mapped
+// there yet, for fault-around and madvise(). Threads sharing
+// the page table fault pages in concurrently, so the PTE is
+// set with compare-and-swap, where mappages() would panic.
+// Returns 0, or -1 if va is mapped already or out of memory.
+static int
+uvminstall(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+
+  if((pte = walk(pagetable, va, 1)) == 0)
     return -1;
-  }
+  if(!__sync_bool_compare_and_swap(pte, 0, PA2PTE(pa) | perm | PTE_V))
+    return -1;
+  return 0;
 }
 
 // allocate and map user memory if process is referencing a page
-// that was lazily allocated in sys_sbrk().
-// returns 0 if va is invalid or already mapped, or if
-// out of physical memory, and physical address if successful.
+// that was lazily allocated in sys_sbrk(), or read it back in
+// if it was swapped out.
+// a read fault maps the shared zero page read-only; a later
+// write fault on it replaces it with a private zeroed page,
+// and a write fault on a merged page (PTE_COW) gives the
+// process its own copy.
+// another thread sharing the page table may handle a fault
+// on the same page at the same time; each PTE change is made
+// with compare-and-swap, and the loser starts over. a fault on
+// a page that is already accessible, which another thread has
+// just mapped, only flushes the stale TLB entry. a threaded
+// process has no zero-page or merged pages (see uvmunshare()),
+// and a read fault in one gets a private page, so that no
+// fault changes the page behind a valid PTE.
+// returns 0 if va is invalid, or if out of physical memory,
+// and physical address if successful.
 uint64
 vmfault(pagetable_t pagetable, uint64 va, int read)
 {
-  uint64 mem;
+  uint64 mem, pa;
+  pte_t *pte, old;
   struct proc *p = myproc();
 
   if (va >= p->sz)
     return 0;
   va = PGROUNDDOWN(va);
-  if(ismapped(pagetable, va)) {
+again:
+  pte = walk(pagetable, va, 0);
+  old = pte ? *pte : 0;
+  if(old & PTE_S)
+    return swapin(pagetable, va);
+  if(pte == 0 && (pte = uvmwalk(pagetable, va)) == 0)
     return 0;
+  if((old & (PTE_V|PTE_U)) == (PTE_V|PTE_U) && (old & (read ? PTE_R : PTE_W))){
+    uvmflushpt(pagetable, va);
+    return PTE2PA(old);
   }
-  mem = (uint64) kalloc();
-  if(mem == 0)
-    return 0;
-  memset((void *) mem, 0, PGSIZE);
-  if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
-    kfree((void *)mem);
-    return 0;
+  if((old & PTE_V) && !read && (old & PTE_COW)){
+    // first write to a merged page: take it back if no other
+    // PTE maps it, or else copy it.
+    pa = PTE2PA(old);
+    switch(ksmunshare(pte, old)){
+    case 1:
+      uvmflushpt(pagetable, va);
+      return pa;
+    case -1:
+      goto again;
+    }
+    while((mem = (uint64) kalloc()) == 0 && swapout() == 0)
+      ;
+    if(mem == 0)
+      return 0;
+    memmove((void*)mem, (void*)pa, PGSIZE);
+    if(!__sync_bool_compare_and_swap(pte, old, PA2PTE(mem) | (PTE_FLAGS(old) & ~PTE_COW) | PTE_W)){
+      kfree((void*)mem);
+      goto again;
+    }
+    uvmflushpt(pagetable, va);
+    ksmput(pa);
+    __sync_fetch_and_add(&vmstats.ksmcow, 1);
+    return mem;
+  }
+  if(old & PTE_V){
+    if(read || PTE2PA(old) != (uint64)zeropage || (old & PTE_U) == 0)
+      return 0;
+    // first write to a page that so far has only been read.
+    if((mem = (uint64) uvmkalloc()) == 0)
+      return 0;
+    if(!__sync_bool_compare_and_swap(pte, old, PA2PTE(mem) | PTE_FLAGS(old) | PTE_W)){
+      kfree((void*)mem);
+      goto again;
+    }
+    uvmflushpt(pagetable, va);
+    __sync_fetch_and_add(&vmstats.zerocopy, 1);
+    return mem;
+  }
+  if(p->leader->nthread > 1)
+    read = 0;
+  if(read){
+    mem = (uint64) zeropage;
+    if(!__sync_bool_compare_and_swap(pte, old, PA2PTE(mem) | PTE_U|PTE_R|PTE_V))
+      goto again;
+    __sync_fetch_and_add(&vmstats.zerofaults, 1);
+  } else {
+    mem = (uint64) uvmkalloc();
+    if(mem == 0)
+      return 0;
+    if(!__sync_bool_compare_and_swap(pte, old, PA2PTE(mem) | PTE_W|PTE_U|PTE_R|PTE_V)){
+      kfree((void *)mem);
+      goto again;
+    }
   }
+  __sync_fetch_and_add(&vmstats.faults, 1);
+  vmfaultaround(p, va, read);
   return mem;
 }
 
+// Adaptive fault-around, called after the lazy fault at va has
+// been handled. If the fault landed just past the previous batch,
+// the access pattern is sequential: map the next pages too,
+// doubling the batch on each such fault up to p->faultaround.
+// Inside a range marked MADV_SEQUENTIAL the batch is always
+// MAXFAULTAROUND. Any other fault resets the batch to zero. A read fault maps
+// the batch to the zero page. Stops early at the end of p->sz,
+// at an already-mapped page, or when out of memory.
+static void
+vmfaultaround(struct proc *p, uint64 va, int read)
+{
+  uint64 a, end;
+  char *mem;
+
+  if(va >= p->seqva && va < p->seqend){
+    // madvise(MADV_SEQUENTIAL): no need to wait for a pattern.
+    p->fawindow = MAXFAULTAROUND;
+  } else if(va == p->fanext && p->faultaround > 0){
+    p->fawindow = p->fawindow ? 2*p->fawindow : 1;
+    if(p->fawindow > p->faultaround)
+      p->fawindow = p->faultaround;
+  } else {
+    p->fawindow = 0;
+  }
+
+  end = va + PGSIZE + (uint64)p->fawindow*PGSIZE;
+  if(end > PGROUNDUP(p->sz))
+    end = PGROUNDUP(p->sz);
+  for(a = va + PGSIZE; a < end; a += PGSIZE){
+    if(ismapped(p->pagetable, a))
+      break;
+    if(read){
+      if(uvminstall(p->pagetable, a, (uint64)zeropage, PTE_U|PTE_R) != 0)
+        break;
+    } else {
+      if((mem = kalloc_zeroed()) == 0)
+        break;
+      if(uvminstall(p->pagetable, a, (uint64)mem, PTE_W|PTE_U|PTE_R) != 0){
+        kfree(mem);
+        break;
+      }
+    }
+    p->nfaultaround++;
+    __sync_fetch_and_add(&vmstats.faultaround, 1);
+  }
+  p->fanext = a;
+}
+
+// Free the pages in [va, va+npages*PGSIZE), for
+// madvise(MADV_DONTNEED); they fault back in as zeros. Pages
+// without PTE_U, such as the stack guard page, are kept.
+// Returns 0, or -1 if out of memory to split a megapage, in
+// which case nothing has been freed.
+static int
+uvmdontneed(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  uint64 a, start, end = va + npages*PGSIZE;
+  pte_t *pte;
+
+  // split first, so that the uvmunmap() calls below, which
+  // start and end beside 4 KB guard pages, can't fail.
+  if(uvmsplitends(pagetable, va, end) != 0)
+    return -1;
+  for(start = a = va; a < end; a += PGSIZE){
+    pte = walk(pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && (*pte & PTE_U) == 0){
+      if(a > start)
+        uvmunmap(pagetable, start, (a - start)/PGSIZE, 1);
+      start = a + PGSIZE;
+    }
+  }
+  if(end > start)
+    uvmunmap(pagetable, start, (end - start)/PGSIZE, 1);
+  return 0;
+}
+
+// Fault in every page in [va, va+npages*PGSIZE) that isn't
+// resident, for madvise(MADV_WILLNEED). Stops quietly when
+// memory runs short, since this is only a hint.
+static void
+uvmwillneed(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  uint64 a, end = va + npages*PGSIZE;
+  pte_t *pte;
+  char *mem;
+
+  for(a = va; a < end; a += PGSIZE){
+    pte = walk(pagetable, a, 0);
+    if(pte && (*pte & PTE_S)){
+      if(swapin(pagetable, a) == 0)
+        break;
+    } else if(pte == 0 || (*pte & PTE_V) == 0){
+      if((mem = kalloc_zeroed()) == 0)
+        break;
+      if(uvminstall(pagetable, a, (uint64)mem, PTE_W|PTE_U|PTE_R) != 0){
+        kfree(mem);
+        break;
+      }
+    } else {
+      continue;
+    }
+    __sync_fetch_and_add(&vmstats.willneed, 1);
+  }
+}
+
+// Give p private, writable copies of its zero-page and merged
+// (PTE_COW) pages, before it gets a second thread. Replacing
+// one changes the physical page behind a valid PTE, which
+// other threads' CPUs might still have cached; with none of
+// them left, a threaded process never needs to.
+// Returns 0, or -1 if out of memory.
+int
+uvmunshare(struct proc *p)
+{
+  pte_t *pte;
+  int level;
+  uint64 va;
+
+  for(va = 0; va < p->sz; va += PGSIZE){
+    if((pte = walklevel(p->pagetable, va, &level)) == 0){
+      va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if(level == 1){
+      va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+      continue;
+    if(PTE2PA(*pte) == (uint64)zeropage || (*pte & PTE_COW)){
+      if(vmfault(p->pagetable, va, 0) == 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Apply madvise() advice to p's pages in [va, va+len).
+// va must be page-aligned, and the range inside p->sz.
+// Returns 0, or -1 if the arguments are bad, or for
+// MADV_DONTNEED, if p has other threads or a megapage
+// couldn't be split.
+int
+uvmadvise(struct proc *p, uint64 va, uint64 len, int advice)
+{
+  uint64 npages;
+
+  if(va % PGSIZE != 0 || va + len < va || va + len > PGROUNDUP(p->sz))
+    return -1;
+  npages = PGROUNDUP(len) / PGSIZE;
+
+  switch(advice){
+  case MADV_NORMAL:
+    p->seqva = p->seqend = 0;
+    break;
+  case MADV_SEQUENTIAL:
+    p->seqva = va;
+    p->seqend = va + npages*PGSIZE;
+    break;
+  case MADV_WILLNEED:
+    uvmwillneed(p->pagetable, va, npages);
+    break;
+  case MADV_DONTNEED:
+    // other threads' CPUs may still have the pages in their TLBs.
+    if(p->leader->nthread > 1)
+      return -1;
+    if(uvmdontneed(p->pagetable, va, npages) != 0)
+      return -1;
+    __sync_fetch_and_add(&vmstats.dontneed, npages);
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+// Working-set sampling. Every WSPERIOD ticks, each process's
+// page table is scanned, and the PTE_A and PTE_D bits of its
+// resident pages are counted and cleared. A cleared PTE_A bit
+// is passed on to swapref(), so that the swap clock still
+// gives the page its second chance. Each pass's counts
+// are averaged into the estimates with weight one half, so
+// older passes decay geometrically. Scanning happens at most
+// WSBUDGET pages per tick, from clockintr() on CPU 0 for
+// processes that aren't running; a process that is running
+// when its pass is due scans itself on its next timer
+// interrupt from user space, in wsself().
+//
+// Threads share their leader's page table, so only leaders are
+// sampled, and a process's figures are the leader's. Other
+// threads may be running while their leader is scanned; they
+// are made to flush their TLBs before they next return to user
+// space, after which the MMU sets the bits again.
+
+#define WSPERIOD  10    // ticks between passes over a process
+#define WSBUDGET  512   // pages scanned per tick
+#define WSSCALE   16    // fixed-point scale of the averages
+
+// Continue p's sampling pass, examining at most budget
+// pages. Returns the number of pages examined.
+// p is a leader. Caller holds p->lock, and p is myproc()
+// or not running.
+static int
+wsscan(struct proc *p, int budget)
+{
+  struct proc *q;
+  pte_t *pte, old;
+  uint64 va;
+  int n = 0, level, npages, cleared = 0;
+
+  if(!p->wsactive){
+    if(ticks - p->wsstart < WSPERIOD)
+      return 0;
+    p->wsactive = 1;
+    p->wsva = 0;
+    p->wsnrss = p->wsnhot = p->wsndirty = 0;
+  }
+
+  while(n < budget && p->wsva < p->sz){
+    va = p->wsva;
+    n++;
+    if((pte = walklevel(p->pagetable, va, &level)) == 0 || level == 1){
+      p->wsva = SUPERPGROUNDDOWN(va) + SUPERPGSIZE;
+      npages = SUPERPGSIZE / PGSIZE;
+    } else {
+      p->wsva = va + PGSIZE;
+      npages = 1;
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+       PTE2PA(*pte) == (uint64)zeropage)
+      continue;
+    p->wsnrss += npages;
+    if((*pte & (PTE_A|PTE_D)) == 0)
+      continue;
+    // atomically, since the MMU may be setting bits meanwhile.
+    old = __sync_fetch_and_and(pte, ~(PTE_A|PTE_D));
+    cleared |= old & (PTE_A|PTE_D);
+    if(old & PTE_A){
+      p->wsnhot += npages;
+      if(level == 0)
+        swapref(PTE2PA(old));
+    }
+    if(old & PTE_D)
+      p->wsndirty += npages;
+  }
+  // so that the MMU sets the bits again on the next access;
+  // not needed if every page was idle.
+  if(cleared){
+    uvmflush(p, -1);
+    if(p->nthread > 1){
+      for(q = procs; q; q = q->allnext)
+        if(q->leader == p && q != p)
+          q->tlbflush = 1;
+    }
+  }
+
+  if(p->wsva >= p->sz){
+    p->wsavg = (p->wsavg + p->wsnhot*WSSCALE) / 2;
+    p->dirtyavg = (p->dirtyavg + p->wsndirty*WSSCALE) / 2;
+    p->rss = p->wsnrss;
+    p->wss = (p->wsavg + WSSCALE/2) / WSSCALE;
+    p->wsdirty = (p->dirtyavg + WSSCALE/2) / WSSCALE;
+    p->wsactive = 0;
+    p->wsstart = ticks;
+  }
+  return n;
+}
+
+// Sample the working sets of processes that aren't running.
+// Called by clockintr() on CPU 0 every tick.
+void
+wstick(void)
+{
+  struct proc *p;
+  int budget = WSBUDGET;
+
+  for(p = procs; p && budget > 0; p = p->allnext){
+    if(p->leader != p)
+      continue;   // sampled with its leader
+    acquire(&p->lock);
+    if(p->state == RUNNING)
+      p->wsdue = p->wsactive || ticks - p->wsstart >= WSPERIOD;
+    else if(p->state == SLEEPING || p->state == RUNNABLE)
+      budget -= wsscan(p, budget);
+    release(&p->lock);
+  }
+}
+
+// Sample the current process's working set, if its pass came
+// due while it was running. Called on a timer interrupt from
+// user space.
+void
+wsself(void)
+{
+  struct proc *p = myproc();
+
+  if(p->leader != p || !p->wsdue)
+    return;
+  acquire(&p->lock);
+  p->wsdue = 0;
+  wsscan(p, WSBUDGET);
+  release(&p->lock);
+}
+
+void
+vmstat_get(struct vmstat *st)
+{
+  *st = vmstats;
+  kallocstat(st);
+  swapstat(st);
+  ksmstat(st);
+  st->slabpages = slabpages();
+}
+
 int
 ismapped(pagetable_t pagetable, uint64 va)
 {
@@ -479,7 +1342,7 @@ ismapped(pagetable_t pagetable, uint64 va)
   if (pte == 0) {
     return 0;
   }
-  if (*pte & PTE_V){
+  if (*pte & (PTE_V|PTE_S)){
     return 1;
   }
   return 0;
@@ -621,70 +1484,162 @@ calc_checksum(char *buf, uint64 len)
   return sum;
 }
 
+// Is the page at va worth saving in a checkpoint: in memory or
+// swapped out, and not the shared zero page?
+static int
+chkpt_present(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte = walk(pagetable, va, 0);
+
+  if(pte == 0)
+    return 0;
+  if(*pte & PTE_S)
+    return 1;
+  return (*pte & PTE_V) && PTE2PA(*pte) != (uint64)zeropage;
+}
+
+// Write len bytes from kernel buf to ip at off, in a
+// transaction of its own.
+static int
+chkpt_write(struct inode *ip, char *buf, uint off, uint len)
+{
+  int n;
+
+  begin_op();
+  ilock(ip);
+  n = writei(ip, 0, (uint64)buf, off, len);
+  iunlock(ip);
+  end_op();
+  return n == len ? 0 : -1;
+}
+
 // Dump memory: Calculates checksum while writing (No Encryption)
+// The dump is a map with one bit per page of [0, sz), set for
+// present pages, followed by just those pages. Pages that were
+// never touched, or were freed with MADV_DONTNEED, take no space.
 int
 vm_dump_integrity(struct proc *tp, struct inode *ip, uint *off, uint64 sz, uint32 *crc)
 {
+  uint64 npages = PGROUNDUP(sz) / PGSIZE;
+  uint mapoff = *off;
+  uint dataoff = *off + (npages + 7) / 8;
   char *page_buf = kalloc();
-  if(page_buf == 0) return -1;
-
-  for(uint64 va = 0; va < sz; va += PGSIZE){
-    uint64 pa = walkaddr(tp->pagetable, va);
-    
-    // If page exists, copy it. If not, write zeros.
-    if(pa == 0)
-      memset(page_buf, 0, PGSIZE);
-    else
-      memmove(page_buf, (void*)pa, PGSIZE);
-
-    // 1. Update Checksum
-    *crc += calc_checksum(page_buf, PGSIZE);
-
-    // 2. Write to Disk (Plaintext)
-    begin_op();
-    ilock(ip);
-    if(writei(ip, 0, (uint64)page_buf, *off, PGSIZE) != PGSIZE){
-      iunlock(ip);
-      end_op();
-      kfree(page_buf);
-      return -1;
+  char *map = kalloc();
+  int r = -1;
+
+  if(page_buf == 0 || map == 0)
+    goto out;
+
+  // one page of the map at a time.
+  for(uint64 i = 0; i < npages; i += PGSIZE*8){
+    uint64 n = npages - i;
+    if(n > PGSIZE*8)
+      n = PGSIZE*8;
+    memset(map, 0, PGSIZE);
+
+    for(uint64 j = 0; j < n; j++){
+      uint64 va = (i + j) * PGSIZE;
+      // If page exists, in memory or in swap, copy it.
+      if(!chkpt_present(tp->pagetable, va) || swapget(tp->pagetable, va, page_buf) == 0)
+        continue;
+      map[j/8] |= 1 << (j%8);
+
+      // 1. Update Checksum
+      *crc += calc_checksum(page_buf, PGSIZE);
+
+      // 2. Write to Disk (Plaintext)
+      if(chkpt_write(ip, page_buf, dataoff, PGSIZE) < 0)
+        goto out;
+      dataoff += PGSIZE;
     }
-    iunlock(ip);
-    end_op();
 
-    *off += PGSIZE;
+    if(chkpt_write(ip, map, mapoff, (n + 7) / 8) < 0)
+      goto out;
+    mapoff += (n + 7) / 8;
   }
-
-  kfree(page_buf);
-  return 0;
+  *off = dataoff;
+  r = 0;
+
+ out:
+  if(page_buf)
+    kfree(page_buf);
+  if(map)
+    kfree(map);
+  return r;
 }
 
 // Restore memory: Verifies checksum while reading
+// Maps a fresh page for each page present in the dump; the
+// rest of [0, sz) is left to fault in lazily. Each run of
+// present pages gets its page-table pages from walkrange()
+// and its data pages from kalloc_batch().
 int
 vm_restore_integrity(pagetable_t pagetable, struct inode *ip, uint *off, uint64 sz, uint32 *crc)
 {
-  char *page_buf = kalloc();
-  if(page_buf == 0) return -1;
+  uint64 npages = PGROUNDUP(sz) / PGSIZE;
+  uint mapoff = *off;
+  uint dataoff = *off + (npages + 7) / 8;
+  char *map = kalloc();
+  void *batch[PTBATCH];
+  int nbatch = 0, used = 0;
+  uint64 left = 0;
+  char *mem;
 
-  for(uint64 va = 0; va < sz; va += PGSIZE){
-    uint64 pa = walkaddr(pagetable, va); // Allocated by uvmalloc
-    if(pa == 0) { kfree(page_buf); return -1; }
+  if(map == 0)
+    return -1;
 
-    // 1. Read from Disk
-    if(readi(ip, 0, (uint64)page_buf, *off, PGSIZE) != PGSIZE){
-      kfree(page_buf);
-      return -1;
-    }
+  for(uint64 i = 0; i < npages; i += PGSIZE*8){
+    uint64 n = npages - i;
+    if(n > PGSIZE*8)
+      n = PGSIZE*8;
+    if(readi(ip, 0, (uint64)map, mapoff, (n + 7) / 8) != (n + 7) / 8)
+      goto bad;
+    mapoff += (n + 7) / 8;
+
+    for(uint64 j = 0; j < n; j++){
+      if((map[j/8] & (1 << (j%8))) == 0)
+        continue;
+      if(left == 0){
+        // a run of present pages starts here.
+        for(left = 1; j + left < n && (map[(j+left)/8] & (1 << ((j+left)%8))); left++)
+          ;
+        if(walkrange(pagetable, (i + j) * PGSIZE, left * PGSIZE, 0) != 0)
+          goto bad;
+      }
+      if(used == nbatch){
+        nbatch = kalloc_batch(batch, left < PTBATCH ? left : PTBATCH, 0);
+        used = 0;
+        if(nbatch == 0)
+          goto bad;
+      }
+      mem = batch[used++];
+      left--;
 
-    // 2. Update Checksum (Calculate what is on disk)
-    *crc += calc_checksum(page_buf, PGSIZE);
+      // 1. Read from Disk
+      if(readi(ip, 0, (uint64)mem, dataoff, PGSIZE) != PGSIZE){
+        kfree(mem);
+        goto bad;
+      }
+      dataoff += PGSIZE;
 
-    // 3. Copy to User Memory
-    memmove((void*)pa, page_buf, PGSIZE);
+      // 2. Update Checksum (Calculate what is on disk)
+      *crc += calc_checksum(mem, PGSIZE);
 
-    *off += PGSIZE;
+      // 3. Map into User Memory
+      if(mappages(pagetable, (i + j) * PGSIZE, PGSIZE, (uint64)mem,
+                  PTE_R | PTE_W | PTE_X | PTE_U) != 0){
+        kfree(mem);
+        goto bad;
+      }
+    }
   }
-
-  kfree(page_buf);
+  *off = dataoff;
+  kfree(map);
   return 0;
-}
\ No newline at end of file
+
+ bad:
+  while(used < nbatch)
+    kfree(batch[used++]);
+  kfree(map);
+  return -1;
+}
@@ -1,2 +1,10 @@
 #define SBRK_EAGER 1
 #define SBRK_LAZY  2
+
+// madvise() advice.
+#define MADV_NORMAL     0   // forget MADV_SEQUENTIAL
+#define MADV_SEQUENTIAL 1   // range will be read in order: fault around eagerly
+#define MADV_WILLNEED   2   // range will be used soon: fault it in now
+#define MADV_DONTNEED   3   // contents not needed: free the pages
+
+#define KNORDER 10     // buddy block orders: 0 (4 KB) .. 9 (2 MB)
@@ -0,0 +1,38 @@
+// Per-CPU page allocator counters.
+struct kcpustat {
+  uint64 nalloc;       // pages handed out by kalloc()
+  uint64 nfree;        // pages returned by kfree()
+  uint64 nrefill;      // batch refills from the global pool
+  uint64 nsteal;       // refills taken from another CPU's list
+  uint64 nbatch;       // kalloc_batch() calls
+};
+
+// Virtual memory counters, reported by the vmstat() system call.
+// Needs param.h for NCPU and vm.h for KNORDER.
+struct vmstat {
+  uint64 faults;       // lazy page faults handled by vmfault()
+  uint64 faultaround;  // pages mapped ahead by fault-around (faults saved)
+  uint64 zerofaults;   // read faults served by the shared zero page
+  uint64 zerocopy;     // zero-page mappings replaced on a later write
+  uint64 freepages;    // free 4 KB pages, in any block size
+  uint64 freeblocks[KNORDER]; // free buddy blocks of each order
+  uint64 slabpages;    // pages held by slab caches
+  uint64 prezeroed;    // pages in the pre-zeroed pool
+  uint64 prezerohit;   // kalloc_zeroed() calls served from the pool
+  uint64 prezeromiss;  // kalloc_zeroed() calls that zeroed a page
+  uint64 swapout;      // pages written to swap
+  uint64 swapin;       // pages read back from swap
+  uint64 swapslots;    // page-sized slots in the swap area
+  uint64 swapused;     // slots holding a page
+  uint64 ksmscanned;   // pages hashed by the same-page merger
+  uint64 ksmmerged;    // pages merged with an identical page
+  uint64 ksmzero;      // zero-filled pages replaced by the zero page
+  uint64 ksmcow;       // merged pages copied on a write
+  uint64 ksmpages;     // merged pages now in memory
+  uint64 ksmsharing;   // PTEs that map them
+  uint64 dontneed;     // pages passed to madvise(MADV_DONTNEED)
+  uint64 willneed;     // pages faulted in by madvise(MADV_WILLNEED)
+  uint64 megapages;    // user megapages mapped by uvmalloc() or uvmcopy()
+  uint64 megasplits;   // megapages split into 4 KB pages
+  struct kcpustat cpu[NCPU];
+};
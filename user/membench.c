@@ -0,0 +1,148 @@
+#include "kernel/types.h"
+#include "user/user.h"
+
+//
+// membench: time memset, memmove and memcmp from ulib.c,
+// which work a word at a time, against byte-at-a-time loops
+// like the ones they replaced, and print bytes per cycle.
+// The kernel's versions in kernel/string.c use the same code.
+//
+// usage: membench [iterations]
+//
+
+#define BUFSZ (64*1024)
+
+static char *a, *b;
+
+static inline uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+static void*
+bytememset(void *dst, int c, uint n)
+{
+  char *d = dst;
+  while(n-- > 0)
+    *d++ = c;
+  return dst;
+}
+
+static void*
+bytememmove(void *dst, const void *src, uint n)
+{
+  char *d = dst;
+  const char *s = src;
+  while(n-- > 0)
+    *d++ = *s++;
+  return dst;
+}
+
+static int
+bytememcmp(const void *v1, const void *v2, uint n)
+{
+  const uchar *s1 = v1, *s2 = v2;
+  while(n-- > 0){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+    s1++, s2++;
+  }
+  return 0;
+}
+
+enum { SET, MOVE, CMP };
+
+// Cycles taken by iters calls of one function on n bytes.
+static uint64
+run(int op, int byte, int doff, int soff, uint n, int iters)
+{
+  uint64 t0 = rdcycle();
+
+  for(int i = 0; i < iters; i++){
+    switch(op){
+    case SET:
+      if(byte)
+        bytememset(a + doff, i, n);
+      else
+        memset(a + doff, i, n);
+      break;
+    case MOVE:
+      if(byte)
+        bytememmove(a + doff, b + soff, n);
+      else
+        memmove(a + doff, b + soff, n);
+      break;
+    case CMP:
+      if(byte)
+        bytememcmp(a + doff, b + soff, n);
+      else
+        memcmp(a + doff, b + soff, n);
+      break;
+    }
+  }
+  return rdcycle() - t0;
+}
+
+// Print bytes per cycle, with two decimals.
+static void
+rate(uint64 bytes, uint64 cycles)
+{
+  uint64 r;
+
+  if(cycles == 0)
+    cycles = 1;
+  r = bytes * 100 / cycles;
+  printf("%d.%d%d", (int)(r / 100), (int)(r / 10 % 10), (int)(r % 10));
+}
+
+static void
+bench(char *name, int op, int doff, int soff, uint n, int iters)
+{
+  uint64 before, after;
+
+  before = run(op, 1, doff, soff, n, iters);
+  after = run(op, 0, doff, soff, n, iters);
+  printf("%s\t%d\t%d/%d\t", name, n, doff, soff);
+  rate((uint64)n * iters, before);
+  printf("\t");
+  rate((uint64)n * iters, after);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int iters = 200;
+
+  if(argc > 1)
+    iters = atoi(argv[1]);
+  if(iters <= 0){
+    fprintf(2, "usage: membench [iterations]\n");
+    exit(1);
+  }
+  a = malloc(BUFSZ + 8);
+  b = malloc(BUFSZ + 8);
+  if(a == 0 || b == 0){
+    fprintf(2, "membench: out of memory\n");
+    exit(1);
+  }
+  // fault the buffers in first, and make b match a for memcmp.
+  bytememset(a, 0, BUFSZ + 8);
+  bytememset(b, 0, BUFSZ + 8);
+
+  printf("op\tbytes\toffsets\tbyte B/cyc\tword B/cyc\n");
+  bench("memset", SET, 0, 0, 4096, iters);
+  bench("memset", SET, 3, 0, 4096, iters);
+  bench("memset", SET, 0, 0, BUFSZ, iters/16 + 1);
+  bench("memmove", MOVE, 0, 0, 4096, iters);
+  bench("memmove", MOVE, 3, 3, 4096, iters);
+  bench("memmove", MOVE, 1, 2, 4096, iters);
+  bench("memmove", MOVE, 0, 0, BUFSZ, iters/16 + 1);
+  bytememset(a, 0, BUFSZ + 8);
+  bench("memcmp", CMP, 0, 0, 4096, iters);
+  bench("memcmp", CMP, 0, 0, BUFSZ, iters/16 + 1);
+  exit(0);
+}
@@ -0,0 +1,106 @@
+// user/parsum.c
+// Sum a large array with 1, 2, 4 and 8 threads sharing it,
+// created by clone(), and print the time each took and the
+// speedup over one thread.
+//
+// usage: parsum [megabytes]
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define MAXT      8
+#define STACKSZ   4096
+
+static uint64 *a;
+static uint64 n;
+static int nt;
+static uint64 sums[MAXT];
+
+static inline uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+// Sum thread i's share of a; doesn't return.
+static void
+worker(void *arg)
+{
+  int i = (int)(uint64)arg;
+  uint64 s = 0;
+
+  for(uint64 j = n * i / nt; j < n * (i+1) / nt; j++)
+    s += a[j];
+  sums[i] = s;
+  exit(0);
+}
+
+// Sum a with t threads; returns the r_time() counts taken.
+static uint64
+run(int t, uint64 *sum)
+{
+  static char *stacks[MAXT];
+  uint64 t0;
+
+  nt = t;
+  t0 = rdtime();
+  for(int i = 0; i < t; i++){
+    if(stacks[i] == 0 && (stacks[i] = malloc(STACKSZ)) == 0){
+      fprintf(2, "parsum: out of memory\n");
+      exit(1);
+    }
+    if(clone(worker, stacks[i] + STACKSZ, (void*)(uint64)i) < 0){
+      fprintf(2, "parsum: clone failed\n");
+      exit(1);
+    }
+  }
+  for(int i = 0; i < t; i++){
+    if(join() < 0){
+      fprintf(2, "parsum: join failed\n");
+      exit(1);
+    }
+  }
+  *sum = 0;
+  for(int i = 0; i < t; i++)
+    *sum += sums[i];
+  return rdtime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb = 16;
+  uint64 one = 0, dt, sum, r;
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(mb <= 0){
+    fprintf(2, "usage: parsum [megabytes]\n");
+    exit(1);
+  }
+  n = (uint64)mb * 1024 * 1024 / sizeof(uint64);
+  if((a = (uint64*)sbrk(n * sizeof(uint64))) == (uint64*)-1){
+    fprintf(2, "parsum: out of memory\n");
+    exit(1);
+  }
+  // fault the array in first, so that the threads only read.
+  for(uint64 j = 0; j < n; j++)
+    a[j] = j;
+
+  printf("threads\tusec\tspeedup\n");
+  for(int t = 1; t <= MAXT; t *= 2){
+    dt = run(t, &sum);
+    if(sum != n * (n - 1) / 2){
+      fprintf(2, "parsum: wrong sum with %d threads\n", t);
+      exit(1);
+    }
+    if(t == 1)
+      one = dt;
+    r = one * 100 / (dt ? dt : 1);
+    printf("%d\t%ld\t%ld.%ld%ld\n", t, dt * 1000000 / TIMEFREQ,
+           r / 100, r / 10 % 10, r % 10);
+  }
+  exit(0);
+}
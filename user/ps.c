@@ -1,11 +1,11 @@
 // user/ps.c
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "kernel/stat.h"
 #include "user/user.h"
 
-// We define the constants and enums that the user program needs,
+// We define the enums that the user program needs,
 // instead of including the whole kernel/proc.h header.
-#define NPROC 64
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 
@@ -27,11 +27,11 @@ const char* get_state_str(int state) {
 int
 main(void)
 {
-  struct proc_info processes[NPROC];
+  static struct proc_info processes[NPROC];
   int count;
 
   // Call the new procinfo system call
-  count = procinfo(processes);
+  count = procinfo(processes, NELEM(processes));
 
   if (count < 0) {
     printf("ps: procinfo failed\n");
@@ -39,11 +39,15 @@ main(void)
   }
 
   // Print header
-  printf("PID\tSTATE\t\tNAME\n");
+  printf("PID\tSTATE\t\tPRI\tCPU\tMIG\tUTIME\tSTIME\tRSS\tWSS\tDIRTY\tNAME\n");
 
   // Loop through the results and print them
   for (int i = 0; i < count; i++) {
-    printf("%d\t%-10s\t%s\n", processes[i].pid, get_state_str(processes[i].state), processes[i].name);
+    printf("%d\t%-10s\t%d\t%d\t%ld\t%ld\t%ld\t%d\t%d\t%d\t%s\n", processes[i].pid,
+           get_state_str(processes[i].state), processes[i].priority,
+           processes[i].cpu, processes[i].migrations,
+           processes[i].utime, processes[i].stime,
+           processes[i].rss, processes[i].wss, processes[i].dirty, processes[i].name);
   }
 
   exit(0);
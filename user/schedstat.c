@@ -0,0 +1,89 @@
+// user/schedstat.c
+// Print the scheduler's latency histograms: how long runnable
+// processes waited for a CPU, how long woken ones waited, and
+// how long each CPU took to switch between processes.
+//
+// usage: schedstat [pid]
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/sched.h"
+#include "user/user.h"
+
+static struct schedstat st[NCPU];
+
+// Print the lower bound of bucket b in microseconds, with
+// one decimal.
+static void
+bound(int b)
+{
+  uint64 t = (1UL << b) * 10000000 / TIMEFREQ;   // tenths of a microsecond
+
+  if(b == 0)
+    t = 0;
+  printf("%ld.%ld", t / 10, t % 10);
+}
+
+static uint64
+total(uint64 *h)
+{
+  uint64 n = 0;
+
+  for(int b = 0; b < NLAT; b++)
+    n += h[b];
+  return n;
+}
+
+static void
+print(struct schedstat *s, int cpu)
+{
+  printf("us >=\twait\twakeup");
+  if(cpu)
+    printf("\tswitch");
+  printf("\n");
+  for(int b = 0; b < NLAT; b++){
+    if(s->wait[b] == 0 && s->wakeup[b] == 0 && s->swtch[b] == 0)
+      continue;
+    bound(b);
+    printf("\t%ld\t%ld", s->wait[b], s->wakeup[b]);
+    if(cpu)
+      printf("\t%ld", s->swtch[b]);
+    printf("\n");
+  }
+  printf("total\t%ld\t%ld", total(s->wait), total(s->wakeup));
+  if(cpu)
+    printf("\t%ld", total(s->swtch));
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pid;
+
+  if(argc > 2){
+    fprintf(2, "usage: schedstat [pid]\n");
+    exit(1);
+  }
+  if(argc == 2){
+    pid = atoi(argv[1]);
+    if(schedstat(pid, &st[0]) < 0){
+      fprintf(2, "schedstat: no process %d\n", pid);
+      exit(1);
+    }
+    printf("pid %d\n", pid);
+    print(&st[0], 0);
+    exit(0);
+  }
+
+  if(schedstat(-1, st) < 0){
+    fprintf(2, "schedstat: schedstat failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < NCPU; i++){
+    if(total(st[i].wait) == 0 && total(st[i].swtch) == 0)
+      continue;
+    printf("cpu %d\n", i);
+    print(&st[i], 1);
+  }
+  exit(0);
+}
@@ -15,7 +15,7 @@ main(int argc, char *argv[])
   // ====================================================
   // We try to restore a file that exists but is NOT a checkpoint.
   // "README" is a standard text file in xv6. 
-  // It contains text, not our Magic Number (0x58563643).
+  // It contains text, not our Magic Number (0x58563644).
   // The kernel MUST reject this, or the system would crash trying to load text as memory.
   
   printf("\n[Test 1] Attempting to restore invalid file 'README'...\n");
@@ -12,6 +12,7 @@
 #define BACK  5
 
 #define MAXARGS 10
+#define MAXACT  16  // spawn() file actions, the kernel's limit
 
 struct cmd {
   int type;
@@ -52,7 +53,10 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 void runcmd(struct cmd*) __attribute__((noreturn));
+int spawnable(struct cmd*);
+int spawncmd(struct cmd*, struct spawnact*, int);
 
 // Execute cmd.  Never returns.
 void
@@ -131,6 +135,102 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Can cmd be run with spawn() instead of fork() and exec()?
+// True of simple commands and pipelines of them, with
+// redirections; they need no shell code in the child.
+int
+spawnable(struct cmd *cmd)
+{
+  struct pipecmd *pcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    return ((struct execcmd*)cmd)->argv[0] != 0;
+  case REDIR:
+    return spawnable(((struct redircmd*)cmd)->cmd);
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    return spawnable(pcmd->left) && spawnable(pcmd->right);
+  }
+  return 0;
+}
+
+// fds the shell has open on behalf of the command being
+// spawned; every spawned process closes its copies.
+int shellfd[MAXACT];
+int nshellfd;
+
+void
+setact(struct spawnact *a, int op, int fd, int newfd)
+{
+  a->op = op;
+  a->fd = fd;
+  a->newfd = newfd;
+}
+
+// Start cmd, which spawnable() accepts, without forking the
+// shell. act[0..nact) are the redirections to apply, from
+// outermost to innermost; act has room for MAXACT entries.
+// Returns the number of processes started.
+int
+spawncmd(struct cmd *cmd, struct spawnact *act, int nact)
+{
+  int i, n, fd, p[2];
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    n = nact;
+    for(i = 0; i < nshellfd && n < MAXACT; i++)
+      setact(&act[n++], SPAWN_CLOSE, shellfd[i], 0);
+    if(i < nshellfd || spawn(ecmd->argv[0], ecmd->argv, act, n) < 0){
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if(nact >= MAXACT){
+      fprintf(2, "too many redirections\n");
+      return 0;
+    }
+    if((fd = open(rcmd->file, rcmd->mode)) < 0){
+      fprintf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    shellfd[nshellfd++] = fd;
+    setact(&act[nact], SPAWN_DUP2, fd, rcmd->fd);
+    n = spawncmd(rcmd->cmd, act, nact+1);
+    nshellfd--;
+    close(fd);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(nact >= MAXACT || nshellfd + 2 > MAXACT){
+      fprintf(2, "pipeline too long\n");
+      return 0;
+    }
+    if(pipe(p) < 0)
+      panic("pipe");
+    shellfd[nshellfd++] = p[0];
+    shellfd[nshellfd++] = p[1];
+    setact(&act[nact], SPAWN_DUP2, p[1], 1);
+    n = spawncmd(pcmd->left, act, nact+1);
+    setact(&act[nact], SPAWN_DUP2, p[0], 0);
+    n += spawncmd(pcmd->right, act, nact+1);
+    nshellfd -= 2;
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+  return 0;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,7 +246,9 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct spawnact act[MAXACT];
+  struct cmd *c;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -168,10 +270,16 @@ main(void)
       cmd[strlen(cmd)-1] = 0;  // chop \n
       if(chdir(cmd+3) < 0)
         fprintf(2, "cannot cd %s\n", cmd+3);
-    } else {
-      if(fork1() == 0)
-        runcmd(parsecmd(cmd));
-      wait(0);
+    } else if((c = parsecmd(cmd)) != 0){
+      if(spawnable(c)){
+        for(n = spawncmd(c, act, 0); n > 0; n--)
+          wait(0);
+      } else {
+        if(fork1() == 0)
+          runcmd(c);
+        wait(0);
+      }
+      freecmd(c);
     }
   }
   exit(0);
@@ -330,18 +438,36 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// Set on a syntax error. The shell parses commands itself,
+// so an error must not exit; instead parsing stops early
+// and parsecmd() returns 0.
+int parseerr;
+
+void
+syntaxerr(char *msg)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", msg);
+  parseerr = 1;
+}
+
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntaxerr("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -385,8 +511,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntaxerr("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -411,8 +539,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntaxerr("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -437,13 +567,18 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntaxerr("syntax");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
+    if(argc >= MAXARGS){
+      syntaxerr("too many args");
+      argc = MAXARGS-1;
+      break;
+    }
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -497,3 +632,41 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Free a command tree made by parsecmd().
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -46,14 +46,32 @@ strlen(const char *s)
   return n;
 }
 
+// memset, memmove and memcmp use the same word-at-a-time
+// loops as the kernel's versions in kernel/string.c.
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = dst;
+  uint64 w;
+
+  if(n >= 32){
+    for(; (uint64)d & 7; n--)
+      *d++ = c;
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    for(; n >= 32; n -= 32, d += 32){
+      ((uint64*)d)[0] = w;
+      ((uint64*)d)[1] = w;
+      ((uint64*)d)[2] = w;
+      ((uint64*)d)[3] = w;
+    }
+    for(; n >= 8; n -= 8, d += 8)
+      *(uint64*)d = w;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -112,17 +130,57 @@ atoi(const char *s)
 void*
 memmove(void *vdst, const void *vsrc, int n)
 {
-  char *dst;
-  const char *src;
+  uchar *dst;
+  const uchar *src;
+  uint64 w0, w1, w2, w3;
+  int words;
 
   dst = vdst;
   src = vsrc;
+  words = n >= 32 && ((uint64)src & 7) == ((uint64)dst & 7);
   if (src > dst) {
+    if (words) {
+      for (; (uint64)dst & 7; n--)
+        *dst++ = *src++;
+      for (; n >= 32; n -= 32, src += 32, dst += 32) {
+        w0 = ((uint64*)src)[0];
+        w1 = ((uint64*)src)[1];
+        w2 = ((uint64*)src)[2];
+        w3 = ((uint64*)src)[3];
+        ((uint64*)dst)[0] = w0;
+        ((uint64*)dst)[1] = w1;
+        ((uint64*)dst)[2] = w2;
+        ((uint64*)dst)[3] = w3;
+      }
+      for (; n >= 8; n -= 8, src += 8, dst += 8)
+        *(uint64*)dst = *(uint64*)src;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if (words) {
+      for (; (uint64)dst & 7; n--)
+        *--dst = *--src;
+      for (; n >= 32; n -= 32) {
+        src -= 32;
+        dst -= 32;
+        w0 = ((uint64*)src)[0];
+        w1 = ((uint64*)src)[1];
+        w2 = ((uint64*)src)[2];
+        w3 = ((uint64*)src)[3];
+        ((uint64*)dst)[3] = w3;
+        ((uint64*)dst)[2] = w2;
+        ((uint64*)dst)[1] = w1;
+        ((uint64*)dst)[0] = w0;
+      }
+      for (; n >= 8; n -= 8) {
+        src -= 8;
+        dst -= 8;
+        *(uint64*)dst = *(uint64*)src;
+      }
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -133,6 +191,15 @@ int
 memcmp(const void *s1, const void *s2, uint n)
 {
   const char *p1 = s1, *p2 = s2;
+  if (n >= 16 && ((uint64)p1 & 7) == ((uint64)p2 & 7)) {
+    for (; (uint64)p1 & 7; n--, p1++, p2++)
+      if (*p1 != *p2)
+        return *p1 - *p2;
+    for (; n >= 8 && *(uint64*)p1 == *(uint64*)p2; n -= 8) {
+      p1 += 8;
+      p2 += 8;
+    }
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
@@ -159,3 +226,80 @@ sbrklazy(int n) {
   return sys_sbrk(n, SBRK_LAZY);
 }
 
+// Mutexes and condition variables on futexes, which enter the
+// kernel only to sleep or to wake a sleeper. A mutex's state
+// is 0 when unlocked, 1 when locked, and 2 when locked and
+// another thread may be sleeping on it; only unlocking a mutex
+// in state 2 calls futex_wake().
+
+void
+mutex_init(struct mutex *m)
+{
+  m->state = 0;
+}
+
+// Acquire m, which is known to be contended: mark it as
+// waited for, and sleep until it is unlocked.
+static void
+mutex_lockslow(struct mutex *m)
+{
+  while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+    futex_wait(&m->state, 2);
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  if(__sync_bool_compare_and_swap(&m->state, 0, 1))
+    return;
+  mutex_lockslow(m);
+}
+
+// Acquire m if it is unlocked. Returns 1 if so, 0 if not.
+int
+mutex_trylock(struct mutex *m)
+{
+  return __sync_bool_compare_and_swap(&m->state, 0, 1);
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2)
+    futex_wake(&m->state, 1);
+}
+
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+}
+
+// Release m, sleep until signalled, and reacquire m. As with
+// any condition variable, the caller must recheck its condition
+// in a loop: a wakeup may be spurious.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  uint seq = c->seq;
+
+  mutex_unlock(m);
+  // returns at once if c was signalled since seq was read.
+  futex_wait(&c->seq, seq);
+  // others may still be sleeping on m, so leave it marked.
+  mutex_lockslow(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 0x7fffffff);
+}
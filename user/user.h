@@ -1,6 +1,20 @@
 #define SBRK_ERROR ((char *)-1)
 
 struct stat;
+struct vmstat;
+struct schedstat;
+struct spawnact;
+
+// a mutex: 0 unlocked, 1 locked, 2 locked and maybe waited for.
+struct mutex {
+  volatile uint state;
+};
+
+// a condition variable: a count of signals, waited on with
+// futex_wait().
+struct cond {
+  volatile uint seq;
+};
 
 // system calls
 int fork(void);
@@ -25,9 +39,23 @@ char* sys_sbrk(int,int);
 int pause(int);
 int uptime(void);
 int hello(void);
-int procinfo(struct proc_info*); 
+int procinfo(struct proc_info*, int);
 int checkpoint(int pid, char *filename);
 int restore(char *filename);
+int vmstat(struct vmstat*);
+int faultaround(int);
+int spawn(const char*, char**, struct spawnact*, int);
+int ksm(int);
+int madvise(void*, int, int);
+int setpriority(int, int);
+int quantum(int, int);
+int sched_setaffinity(int, uint64);
+int sched_getaffinity(int);
+int schedstat(int, struct schedstat*);
+int clone(void (*)(void*), void*, void*);
+int join(void);
+int futex_wait(volatile uint*, uint);
+int futex_wake(volatile uint*, int);
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
@@ -42,6 +70,14 @@ int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
 char* sbrk(int);
 char* sbrklazy(int);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+int mutex_trylock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
 
 // printf.c
 void fprintf(int, const char*, ...) __attribute__ ((format (printf, 2, 3)));
@@ -7,6 +7,9 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/vm.h"
+#include "kernel/vmstat.h"
+#include "kernel/sched.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2748,6 +2751,1220 @@ lazy_sbrk(char *s)
   exit(0);
 }
 
+// a sequential walk over lazily allocated memory should have
+// fault-around map pages ahead, unless it has been disabled.
+void
+lazy_faultaround(char *s)
+{
+  struct vmstat st0, st1;
+  char *p;
+  int i, n = 256;
+
+  for(int limit = FAULTAROUND; limit >= 0; limit -= FAULTAROUND){
+    faultaround(limit);
+    if(vmstat(&st0) < 0){
+      printf("%s: vmstat failed\n", s);
+      exit(1);
+    }
+    p = sbrklazy(n*PGSIZE);
+    if(p == SBRK_ERROR){
+      printf("%s: sbrklazy failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < n; i++){
+      if(p[i*PGSIZE] != 0){
+        printf("%s: lazy page not zero\n", s);
+        exit(1);
+      }
+      p[i*PGSIZE] = 1;
+    }
+    vmstat(&st1);
+    if(limit > 0 && st1.faultaround == st0.faultaround){
+      printf("%s: no pages mapped ahead\n", s);
+      exit(1);
+    }
+    if(limit == 0 && st1.faults - st0.faults < n){
+      printf("%s: fault-around not disabled\n", s);
+      exit(1);
+    }
+    sbrklazy(-n*PGSIZE);
+  }
+
+  exit(0);
+}
+
+// reading untouched lazy memory should map the shared zero
+// page; writing one of those pages must not affect the others.
+void
+lazy_zeropage(char *s)
+{
+  struct vmstat st0, st1;
+  char *p;
+  int i, n = 64, pid, xstatus;
+
+  faultaround(0);
+  vmstat(&st0);
+  p = sbrklazy(n*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    if(p[i*PGSIZE] != 0){
+      printf("%s: lazy page not zero\n", s);
+      exit(1);
+    }
+  }
+  vmstat(&st1);
+  if(st1.zerofaults - st0.zerofaults < n){
+    printf("%s: reads did not use the zero page\n", s);
+    exit(1);
+  }
+
+  p[3*PGSIZE] = 'x';
+  for(i = 0; i < n; i++){
+    if(p[i*PGSIZE] != (i == 3 ? 'x' : 0)){
+      printf("%s: zero page was written\n", s);
+      exit(1);
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[5*PGSIZE] = 'y';
+    exit(p[3*PGSIZE] == 'x' && p[4*PGSIZE] == 0 ? 0 : 1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[5*PGSIZE] != 0){
+    printf("%s: fork shared a written zero page\n", s);
+    exit(1);
+  }
+
+  exit(0);
+}
+
+// grow the heap by enough to be mapped with megapages, then
+// check that fork copies them and that shrinking into the
+// middle of a megapage (which splits it) keeps the rest.
+void
+superpg(char *s)
+{
+  struct vmstat st0, st1;
+  char *a, *p;
+  int pid, xstatus;
+  uint64 i;
+
+  a = sbrk(0);
+  if(sbrk(SUPERPGROUNDUP((uint64)a) - (uint64)a) == SBRK_ERROR){
+    printf("%s: sbrk align failed\n", s);
+    exit(1);
+  }
+  if(vmstat(&st0) < 0){
+    printf("%s: vmstat failed\n", s);
+    exit(1);
+  }
+  p = sbrk(2*SUPERPGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  vmstat(&st1);
+  if(st1.megapages - st0.megapages < 2){
+    printf("%s: heap not mapped with megapages\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*SUPERPGSIZE; i += PGSIZE)
+    p[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 2*SUPERPGSIZE; i += PGSIZE){
+      if(p[i] != (char)(i / PGSIZE)){
+        printf("%s: child read wrong value\n", s);
+        exit(1);
+      }
+      p[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  vmstat(&st0);
+  if(sbrk(-(SUPERPGSIZE/2)) == SBRK_ERROR){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  vmstat(&st1);
+  if(st1.megasplits == st0.megasplits){
+    printf("%s: shrink didn't split a megapage\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*SUPERPGSIZE - SUPERPGSIZE/2; i += PGSIZE){
+    if(p[i] != (char)(i / PGSIZE)){
+      printf("%s: wrong value after split\n", s);
+      exit(1);
+    }
+  }
+
+  exit(0);
+}
+
+// more open files than the old fixed file table held,
+// which filealloc() now gets from a slab cache.
+void
+manyfiles(char *s)
+{
+  int ready[2], go[2], fds[2];
+  int i, j, n = 12, xstatus, failed = 0;
+  char c;
+
+  if(pipe(ready) < 0 || pipe(go) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(ready[0]);
+      close(go[1]);
+      for(j = 0; j < 5; j++){
+        if(pipe(fds) < 0){
+          printf("%s: pipe %d failed\n", s, j);
+          write(ready[1], "n", 1);
+          exit(1);
+        }
+      }
+      write(ready[1], "y", 1);
+      read(go[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  close(go[0]);
+  for(i = 0; i < n; i++){
+    if(read(ready[0], &c, 1) != 1 || c != 'y')
+      failed = 1;
+  }
+  close(go[1]);
+  for(i = 0; i < n; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      failed = 1;
+  }
+  close(ready[0]);
+  if(failed){
+    printf("%s: children could not open their files\n", s);
+    exit(1);
+  }
+}
+
+// pages from the pool that idle CPUs pre-zero
+// must really be zero.
+void
+prezero(char *s)
+{
+  struct vmstat st0, st1;
+  char *p;
+  int i, n = 32;
+
+  pause(2);   // let idle CPUs fill the pool
+  vmstat(&st0);
+  p = sbrk(n*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n*PGSIZE; i++){
+    if(p[i] != 0){
+      printf("%s: byte %d not zero\n", s, i);
+      exit(1);
+    }
+  }
+  vmstat(&st1);
+  if(st1.prezerohit == st0.prezerohit){
+    printf("%s: no pre-zeroed pages used\n", s);
+    exit(1);
+  }
+  sbrk(-n*PGSIZE);
+}
+
+// touch more memory than is free, so that some of it
+// has to be swapped out, and check that it all reads back.
+void
+swaptest(char *s)
+{
+  struct vmstat st0, st1;
+  uint64 i, n;
+  char *p;
+  int pid, xstatus;
+
+  vmstat(&st0);
+  if(st0.swapslots < 512){
+    printf("%s: no swap area\n", s);
+    exit(1);
+  }
+  n = st0.freepages + 256;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // lazily, so the memory comes in 4 KB pages.
+    p = sbrklazy(n*PGSIZE);
+    if(p == SBRK_ERROR){
+      printf("%s: sbrklazy failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < n; i++)
+      *(uint64*)(p + i*PGSIZE) = i;
+    for(i = 0; i < n; i++){
+      if(*(uint64*)(p + i*PGSIZE) != i){
+        printf("%s: page %ld has the wrong contents\n", s, i);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+
+  vmstat(&st1);
+  if(st1.swapout == st0.swapout || st1.swapin == st0.swapin){
+    printf("%s: nothing was swapped\n", s);
+    exit(1);
+  }
+  if(st1.swapused != st0.swapused){
+    printf("%s: swap slots leaked\n", s);
+    exit(1);
+  }
+}
+
+// a process that keeps writing the same pages should see
+// them counted in its working set and dirty estimates.
+void
+wsstest(char *s)
+{
+  static struct proc_info pi[NPROC];
+  int i, k, n = 64, t0;
+  char *p;
+
+  p = sbrk(n*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  for(k = 0; uptime() - t0 < 30; k++)
+    for(i = 0; i < n; i++)
+      p[i*PGSIZE] = k;
+
+  k = procinfo(pi, NPROC);
+  for(i = 0; i < k && pi[i].pid != getpid(); i++)
+    ;
+  if(i == k){
+    printf("%s: procinfo has no entry for us\n", s);
+    exit(1);
+  }
+  if(pi[i].rss < n || pi[i].wss < n/2 || pi[i].dirty < n/2){
+    printf("%s: rss %d wss %d dirty %d, want >= %d, %d, %d\n",
+           s, pi[i].rss, pi[i].wss, pi[i].dirty, n, n/2, n/2);
+    exit(1);
+  }
+  sbrk(-n*PGSIZE);
+}
+
+// spawn() a process with its output redirected to a pipe,
+// and check that bad file actions and paths are refused.
+void
+spawntest(char *s)
+{
+  char *echoargv[] = { "echo", "OK", 0 };
+  struct spawnact act[2];
+  int fds[2], pid, xstatus;
+  char buf[4];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  act[0].op = SPAWN_DUP2;
+  act[0].fd = fds[1];
+  act[0].newfd = 1;
+  act[1].op = SPAWN_CLOSE;
+  act[1].fd = fds[0];
+  pid = spawn("echo", echoargv, act, 2);
+  if(pid < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  if(read(fds[0], buf, 2) != 2 || buf[0] != 'O' || buf[1] != 'K'){
+    printf("%s: wrong output from spawned echo\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+
+  if(spawn("nosuchprogram", echoargv, 0, 0) >= 0){
+    printf("%s: spawned a nonexistent program\n", s);
+    exit(1);
+  }
+  act[0].op = SPAWN_CLOSE;
+  act[0].fd = NOFILE - 1;
+  if(spawn("echo", echoargv, act, 1) >= 0){
+    printf("%s: spawn closed an unopened fd\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+}
+
+// children holding identical pages should have them merged
+// while they pause, and get private copies back on a write.
+void
+ksmtest(char *s)
+{
+  struct vmstat st0, st1;
+  int i, j, k, n = 16, nchild = 4, old, pid, xstatus;
+  char *p;
+
+  vmstat(&st0);
+  old = ksm(1);
+  for(k = 0; k < nchild; k++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      p = sbrk(n*PGSIZE);
+      if(p == SBRK_ERROR)
+        exit(1);
+      for(i = 0; i < n; i++)
+        memset(p + i*PGSIZE, 'a' + i, PGSIZE);
+      pause(30);
+      for(i = 0; i < n; i++){
+        p[i*PGSIZE] = k;
+        for(j = 1; j < PGSIZE; j++)
+          if(p[i*PGSIZE + j] != 'a' + i)
+            exit(1);
+        if(p[i*PGSIZE] != k)
+          exit(1);
+      }
+      exit(0);
+    }
+  }
+  for(k = 0; k < nchild; k++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child saw the wrong contents\n", s);
+      exit(1);
+    }
+  }
+  ksm(old);
+
+  vmstat(&st1);
+  if(st1.ksmmerged == st0.ksmmerged || st1.ksmcow == st0.ksmcow){
+    printf("%s: merged %ld, copied %ld\n", s,
+           st1.ksmmerged - st0.ksmmerged, st1.ksmcow - st0.ksmcow);
+    exit(1);
+  }
+}
+
+// MADV_DONTNEED frees pages that then read back as zeros;
+// MADV_WILLNEED faults pages in ahead of use.
+void
+madvtest(char *s)
+{
+  struct vmstat st0, st1;
+  int i, n = 16;
+  char *p;
+
+  p = sbrk(n*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  memset(p, 'x', n*PGSIZE);
+  vmstat(&st0);
+  if(madvise(p + 4*PGSIZE, 8*PGSIZE, MADV_DONTNEED) < 0){
+    printf("%s: madvise DONTNEED failed\n", s);
+    exit(1);
+  }
+  vmstat(&st1);
+  if(st1.freepages < st0.freepages + 8){
+    printf("%s: DONTNEED freed %ld pages, want 8\n", s, st1.freepages - st0.freepages);
+    exit(1);
+  }
+  for(i = 0; i < n*PGSIZE; i += 512){
+    if(p[i] != ((i >= 4*PGSIZE && i < 12*PGSIZE) ? 0 : 'x')){
+      printf("%s: wrong contents at offset %d\n", s, i);
+      exit(1);
+    }
+  }
+  sbrk(-n*PGSIZE);
+
+  p = sbrklazy(n*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  if(madvise(p, n*PGSIZE, MADV_WILLNEED) < 0){
+    printf("%s: madvise WILLNEED failed\n", s);
+    exit(1);
+  }
+  vmstat(&st0);
+  for(i = 0; i < n; i++)
+    p[i*PGSIZE] = i;
+  vmstat(&st1);
+  if(st1.faults != st0.faults){
+    printf("%s: %ld faults after WILLNEED\n", s, st1.faults - st0.faults);
+    exit(1);
+  }
+  if(madvise(p + 1, PGSIZE, MADV_DONTNEED) != -1 ||
+     madvise(p, (n+1)*PGSIZE, MADV_DONTNEED) != -1 ||
+     madvise(p, PGSIZE, 99) != -1){
+    printf("%s: bad madvise arguments accepted\n", s);
+    exit(1);
+  }
+  sbrk(-n*PGSIZE);
+}
+
+// memset, memmove and memcmp on every alignment and overlap,
+// in user space and, through a pipe, in the kernel.
+void
+memfntest(char *s)
+{
+  static char a[256], b[256], want[256];
+  int fds[2], d, o, n, i;
+
+  for(d = 0; d < 8; d++){
+    for(o = -12; o <= 12; o++){
+      for(n = 0; n < 80; n += 7){
+        for(i = 0; i < sizeof(a); i++)
+          a[i] = want[i] = i * 7 + 1;
+        for(i = 0; i < n; i++)
+          b[i] = want[64 + o + d + i];
+        for(i = 0; i < n; i++)
+          want[64 + d + i] = b[i];
+        memmove(a + 64 + d, a + 64 + o + d, n);
+        if(memcmp(a, want, sizeof(a)) != 0){
+          printf("%s: memmove %d %d %d wrong\n", s, d, o, n);
+          exit(1);
+        }
+        memset(a + d, 'z', n);
+        for(i = 0; i < n; i++)
+          want[d + i] = 'z';
+        if(memcmp(a, want, sizeof(a)) != 0){
+          printf("%s: memset %d %d wrong\n", s, d, n);
+          exit(1);
+        }
+        if(n > 0){
+          want[d + n - 1] ^= 1;
+          if(memcmp(a + d, want + d, n) == 0){
+            printf("%s: memcmp %d %d missed a difference\n", s, d, n);
+            exit(1);
+          }
+        }
+      }
+    }
+  }
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(a); i++)
+    a[i] = i;
+  for(d = 0; d < 8; d++){
+    memset(b, 0, sizeof(b));
+    if(write(fds[1], a + d, 200) != 200 || read(fds[0], b + 7 - d, 200) != 200 ||
+       memcmp(a + d, b + 7 - d, 200) != 0){
+      printf("%s: pipe copy at offset %d wrong\n", s, d);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// growing memory eagerly allocates pages in batches, and
+// they come back zeroed.
+void
+batchtest(char *s)
+{
+  struct vmstat st0, st1;
+  uint64 b0 = 0, b1 = 0;
+  int i, n = 100;
+  char *p;
+
+  vmstat(&st0);
+  p = sbrk(n*PGSIZE);
+  if(p == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  vmstat(&st1);
+  for(i = 0; i < NCPU; i++){
+    b0 += st0.cpu[i].nbatch;
+    b1 += st1.cpu[i].nbatch;
+  }
+  if(b1 - b0 < 1){
+    printf("%s: no batched allocations\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n*PGSIZE; i += 64){
+    if(p[i] != 0){
+      printf("%s: page not zeroed at offset %d\n", s, i);
+      exit(1);
+    }
+  }
+  sbrk(-n*PGSIZE);
+}
+
+// more CPU-bound children than CPUs, which must all get to
+// run, by being stolen from the forking CPU's run queue: with
+// more than one CPU online, they must not all run on one.
+void
+runqtest(char *s)
+{
+  static struct proc_info info[NPROC];
+  int i, j, pid, n = 3*NCPU, xst, done = 0, ncpu = 0, nran = 0, t0, np;
+  int pids[3*NCPU];
+  int all = sched_getaffinity(getpid());
+  uint64 ran = 0, m;
+  volatile uint64 x;
+
+  // count the online CPUs: a mask with none is refused.
+  for(i = 0; i < NCPU; i++)
+    if(sched_setaffinity(getpid(), 1UL << i) == 0)
+      ncpu++;
+  sched_setaffinity(getpid(), all);
+
+  for(i = 0; i < n; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(x = 0; x < 2000000; x++)
+        ;
+      exit(i + 1);
+    }
+    pids[i] = pid;
+  }
+  // exited children stay listed, with the CPU that last ran
+  // them, until they are waited for.
+  t0 = uptime();
+  do {
+    pause(1);
+    np = procinfo(info, NPROC);
+    for(j = 0; j < np; j++)
+      for(i = 0; i < n; i++)
+        if(info[j].pid == pids[i] && info[j].cpu >= 0)
+          ran |= 1UL << info[j].cpu;
+    for(m = ran, nran = 0; m; m &= m - 1)
+      nran++;
+  } while(nran < 2 && ncpu > 1 && uptime() - t0 < 50);
+  for(i = 0; i < n; i++){
+    if(wait(&xst) < 0 || xst < 1 || xst > n){
+      printf("%s: wait failed\n", s);
+      exit(1);
+    }
+    done |= 1 << (xst - 1);
+  }
+  if(done != (1 << n) - 1){
+    printf("%s: not every child ran\n", s);
+    exit(1);
+  }
+  if(ncpu > 1 && nran < 2){
+    printf("%s: no child ran on another CPU\n", s);
+    exit(1);
+  }
+}
+
+// children sleeping on many different channels at once, and
+// a killed sleeper, are each woken.
+void
+waitqtest(char *s)
+{
+  enum { N = 20 };
+  int fds[N][2], pids[N], i, xst, done = 0;
+  char c;
+
+  for(i = 0; i < N; i++){
+    if(pipe(fds[i]) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    if((pids[i] = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      if(read(fds[i][0], &c, 1) != 1 || c != 'a' + i)
+        exit(-1);
+      exit(i);
+    }
+  }
+  pause(2);
+  kill(pids[N-1]);
+  for(i = N-2; i >= 0; i--){
+    c = 'a' + i;
+    write(fds[i][1], &c, 1);
+  }
+  for(i = 0; i < N; i++){
+    if(wait(&xst) < 0){
+      printf("%s: a child was not woken\n", s);
+      exit(1);
+    }
+    if(xst < -1 || xst >= N-1 || (done & (1 << (xst + 1)))){
+      printf("%s: bad exit status %d\n", s, xst);
+      exit(1);
+    }
+    done |= 1 << (xst + 1);
+  }
+  for(i = 0; i < N; i++){
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+}
+
+// a CPU-bound process drops to the lowest priority and is
+// charged user time; setpriority() checks its arguments.
+void
+mlfqtest(char *s)
+{
+  static struct proc_info info[NPROC];
+  int pid, i, n, t0, ok = 0;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(;;)
+      ;
+  }
+  t0 = uptime();
+  while(!ok && uptime() - t0 < 2*BOOSTTICKS){
+    pause(1);
+    n = procinfo(info, NPROC);
+    for(i = 0; i < n; i++)
+      if(info[i].pid == pid && info[i].priority == NPRIO-1 && info[i].utime > 0)
+        ok = 1;
+  }
+  kill(pid);
+  wait(0);
+  if(!ok){
+    printf("%s: spinning child never reached the lowest priority\n", s);
+    exit(1);
+  }
+
+  if(setpriority(getpid(), NPRIO) != -1 || setpriority(getpid(), -1) != -1 ||
+     setpriority(pid, 0) != -1){
+    printf("%s: bad setpriority arguments accepted\n", s);
+    exit(1);
+  }
+  if(setpriority(getpid(), 0) < 0){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
+  }
+}
+
+// a short quantum doesn't change the length of a tick, as seen
+// by pause() and uptime().
+void
+quantumtest(char *s)
+{
+  int old, t0, t1;
+
+  if((old = quantum(0, -1)) < 1 || quantum(101, -1) != -1){
+    printf("%s: quantum() query or range check failed\n", s);
+    exit(1);
+  }
+  if(quantum(1, 1) != old || quantum(0, -1) != 1){
+    printf("%s: quantum(1) failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  pause(3);
+  t1 = uptime();
+  quantum(old, -1);
+  if(t1 - t0 < 3 || t1 - t0 > 5){
+    printf("%s: pause(3) took %d ticks with a 1 ms quantum\n", s, t1 - t0);
+    exit(1);
+  }
+}
+
+// procinfo() reports more processes than fit in one kernel
+// batch, with the caller's own fields filled in.
+void
+procinfotest(char *s)
+{
+  enum { N = 40 };
+  static struct proc_info info[NPROC];
+  int fds[2], i, j, n, found = 0, self = 0;
+  int pids[N];
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+
+  n = procinfo(info, NPROC);
+  for(j = 0; j < n; j++){
+    if(info[j].pid == getpid()){
+      self = 1;
+      if(strcmp(info[j].name, "usertests") != 0 || info[j].cpu < 0 ||
+         info[j].cpu >= NCPU || info[j].affinity != sched_getaffinity(getpid())){
+        printf("%s: wrong fields for this process\n", s);
+        exit(1);
+      }
+    }
+    for(i = 0; i < N; i++)
+      if(info[j].pid == pids[i])
+        found++;
+  }
+  if(!self || found != N){
+    printf("%s: %d of %d children listed\n", s, found, N);
+    exit(1);
+  }
+
+  close(fds[1]);
+  for(i = 0; i < N; i++)
+    wait(0);
+}
+
+// a process pinned to CPU 0 runs only there, its children
+// inherit the mask, and bad masks and pids are refused.
+void
+affinitytest(char *s)
+{
+  static struct proc_info info[NPROC];
+  int pid, i, n, t0, ok = 0, bad = 0;
+  int all = sched_getaffinity(getpid());
+
+  if(all <= 0 || sched_getaffinity(-1) != -1){
+    printf("%s: sched_getaffinity failed\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(getpid(), 0) != -1 || sched_setaffinity(-1, 1) != -1){
+    printf("%s: bad sched_setaffinity arguments accepted\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(getpid(), 1) < 0 || sched_getaffinity(getpid()) != 1){
+    printf("%s: sched_setaffinity failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(;;)
+      ;
+  }
+  sched_setaffinity(getpid(), all);
+  if(sched_getaffinity(pid) != 1){
+    printf("%s: child didn't inherit the mask\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  while(uptime() - t0 < 10){
+    pause(1);
+    n = procinfo(info, NPROC);
+    for(i = 0; i < n; i++){
+      if(info[i].pid != pid || info[i].cpu < 0)
+        continue;
+      ok = 1;
+      if(info[i].cpu != 0)
+        bad = 1;
+    }
+  }
+  kill(pid);
+  wait(0);
+  if(!ok || bad){
+    printf("%s: pinned child ran on another CPU\n", s);
+    exit(1);
+  }
+}
+
+// pages allocated on one CPU and freed on another go on the
+// freeing CPU's list, and a CPU whose list and the buddy
+// allocator are both empty steals from that list, before it
+// would swap anything out.
+void
+kalloccpu(char *s)
+{
+  enum { N = 64, CHUNK = 16 };
+  struct vmstat st0, st1;
+  int all = sched_getaffinity(getpid());
+  int a, b, pid, xstatus;
+  uint64 n, limit;
+
+  // the first two online CPUs: a mask with none is refused.
+  for(a = 0; a < NCPU && sched_setaffinity(getpid(), 1UL << a) < 0; a++)
+    ;
+  for(b = a+1; b < NCPU && sched_setaffinity(getpid(), 1UL << b) < 0; b++)
+    ;
+  sched_setaffinity(getpid(), all);
+  if(b >= NCPU){
+    printf("[only one CPU, skipping] ");
+    return;
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // allocate on a, then move to b and free there.
+    sched_setaffinity(getpid(), 1UL << a);
+    pause(1);
+    vmstat(&st0);
+    if(sbrk(N*PGSIZE) == SBRK_ERROR){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    sched_setaffinity(getpid(), 1UL << b);
+    pause(1);
+    sbrk(-N*PGSIZE);
+    vmstat(&st1);
+    if(st1.cpu[b].nfree - st0.cpu[b].nfree < N){
+      printf("%s: pages not freed to the other CPU's list\n", s);
+      exit(1);
+    }
+
+    // back on a, use up the buddy allocator and a's list; a
+    // page must be stolen from b's list before all the free
+    // memory but b's N pages is gone, and so before anything
+    // is swapped out.
+    sched_setaffinity(getpid(), 1UL << a);
+    pause(1);
+    vmstat(&st0);
+    limit = st0.freepages > N + CHUNK ? st0.freepages - N - CHUNK : 0;
+    for(n = 0, st1 = st0; st1.cpu[a].nsteal == st0.cpu[a].nsteal; n += CHUNK){
+      if(n >= limit || sbrk(CHUNK*PGSIZE) == SBRK_ERROR){
+        printf("%s: %ld pages allocated without a steal\n", s, n);
+        exit(1);
+      }
+      vmstat(&st1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+}
+
+// a process that pause()s is woken and its waits recorded in
+// its own and the CPUs' latency histograms.
+void
+schedstattest(char *s)
+{
+  static struct schedstat st[NCPU];
+  uint64 wait = 0, wakeup = 0, swtch = 0;
+
+  for(int i = 0; i < 3; i++)
+    pause(1);
+  if(schedstat(getpid(), &st[0]) < 0 || schedstat(0, &st[0]) != -1 ||
+     schedstat(12345, &st[0]) != -1){
+    printf("%s: schedstat(pid) failed\n", s);
+    exit(1);
+  }
+  for(int b = 0; b < NLAT; b++){
+    wait += st[0].wait[b];
+    wakeup += st[0].wakeup[b];
+  }
+  if(wakeup < 3 || wait < wakeup){
+    printf("%s: %ld wakeups and %ld waits recorded\n", s, wakeup, wait);
+    exit(1);
+  }
+  if(schedstat(-1, st) < 0){
+    printf("%s: schedstat(-1) failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < NCPU; i++)
+    for(int b = 0; b < NLAT; b++)
+      swtch += st[i].swtch[b];
+  if(swtch == 0){
+    printf("%s: no context switches recorded\n", s);
+    exit(1);
+  }
+}
+
+// more processes than the old fixed table of 64 can exist at
+// once, and each is found by pid.
+void
+proctabletest(char *s)
+{
+  enum { N = 100 };
+  static int pids[N];
+  static struct proc_info info[NPROC];
+  int fds[2], i, j, n, found;
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork %d failed\n", s, i);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+
+  n = procinfo(info, NPROC);
+  for(i = 0; i < N; i++){
+    found = 0;
+    for(j = 0; j < n; j++)
+      if(info[j].pid == pids[i])
+        found = 1;
+    if(!found || sched_getaffinity(pids[i]) < 0){
+      printf("%s: child %d not found\n", s, pids[i]);
+      exit(1);
+    }
+  }
+  if(procinfo(info, 3) != 3){
+    printf("%s: procinfo ignored its limit\n", s);
+    exit(1);
+  }
+
+  close(fds[1]);
+  for(i = 0; i < N; i++){
+    if(wait(0) < 0){
+      printf("%s: wait failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    if(kill(pids[i]) != -1){
+      printf("%s: reaped child %d can still be killed\n", s, pids[i]);
+      exit(1);
+    }
+  }
+}
+
+// threads made by clone() share memory and file descriptors,
+// and join() reaps each of them once.
+static volatile int clonecount;
+static int clonefd;
+
+// wait until the main thread writes to the lazily allocated
+// word that it had only read before cloning this thread.
+static volatile int *clonezero;
+static int clonezerook;
+
+static void
+clonereader(void *arg)
+{
+  int t0 = uptime();
+
+  while(*clonezero == 0)
+    if(uptime() - t0 > 50)
+      exit(1);
+  clonezerook = 1;
+  exit(0);
+}
+
+static void
+clonechild(void *arg)
+{
+  for(int i = 0; i < 1000; i++)
+    __sync_fetch_and_add(&clonecount, (int)(uint64)arg);
+  if(write(clonefd, "x", 1) != 1)
+    exit(1);
+  exit(0);
+}
+
+void
+clonetest(char *s)
+{
+  enum { N = 8 };
+  static char stacks[N][4096];
+  int fds[2], i, tid;
+  char buf[N];
+
+  if(join() != -1){
+    printf("%s: join with no threads succeeded\n", s);
+    exit(1);
+  }
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  clonefd = fds[1];
+  clonecount = 0;
+  for(i = 0; i < N; i++){
+    if(clone(clonechild, stacks[i] + sizeof(stacks[i]), (void*)(uint64)(i+1)) < 0){
+      printf("%s: clone %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    if((tid = join()) <= 0){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(join() != -1){
+    printf("%s: join after all threads succeeded\n", s);
+    exit(1);
+  }
+  if(clonecount != 1000 * N * (N+1) / 2){
+    printf("%s: count %d, not %d\n", s, clonecount, 1000 * N * (N+1) / 2);
+    exit(1);
+  }
+  close(fds[1]);
+  if(read(fds[0], buf, N) != N){
+    printf("%s: threads didn't write to the shared pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+
+  // the zero page must not stay mapped for the reader once
+  // this thread writes.
+  if((clonezero = (int*)sbrklazy(PGSIZE)) == (int*)SBRK_ERROR){
+    printf("%s: sbrklazy failed\n", s);
+    exit(1);
+  }
+  if(*clonezero != 0 || clone(clonereader, stacks[0] + sizeof(stacks[0]), 0) < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  pause(1);
+  *clonezero = 1;
+  if(join() < 0 || !clonezerook){
+    printf("%s: thread still saw the zero page\n", s);
+    exit(1);
+  }
+}
+
+// futexes, and the mutexes and condition variables built on
+// them, keep threads in step without spinning.
+static struct mutex futexmu;
+static struct cond futexcv;
+static int futexcount, futexready;
+
+static void
+futexchild(void *arg)
+{
+  for(int i = 0; i < 1000; i++){
+    mutex_lock(&futexmu);
+    futexcount++;          // not atomic: the mutex protects it
+    mutex_unlock(&futexmu);
+  }
+  mutex_lock(&futexmu);
+  while(futexready == 0)
+    cond_wait(&futexcv, &futexmu);
+  futexready++;
+  mutex_unlock(&futexmu);
+  exit(0);
+}
+
+void
+futextest(char *s)
+{
+  enum { N = 4 };
+  static char stacks[N][4096];
+  static uint word;
+  int i;
+
+  word = 1;
+  if(futex_wait(&word, 0) != -1){
+    printf("%s: futex_wait slept on a changed word\n", s);
+    exit(1);
+  }
+  if(futex_wait((uint*)((char*)&word + 1), 1) != -1){
+    printf("%s: futex_wait accepted a misaligned address\n", s);
+    exit(1);
+  }
+  if(futex_wake(&word, 1) != 0){
+    printf("%s: futex_wake woke a process that wasn't waiting\n", s);
+    exit(1);
+  }
+
+  mutex_init(&futexmu);
+  cond_init(&futexcv);
+  futexcount = 0;
+  futexready = 0;
+  for(i = 0; i < N; i++){
+    if(clone(futexchild, stacks[i] + sizeof(stacks[i]), 0) < 0){
+      printf("%s: clone %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  // let the threads go to sleep on the condition variable.
+  pause(2);
+  mutex_lock(&futexmu);
+  futexready = 1;
+  cond_broadcast(&futexcv);
+  mutex_unlock(&futexmu);
+  for(i = 0; i < N; i++){
+    if(join() < 0){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(futexcount != 1000 * N){
+    printf("%s: count %d, not %d\n", s, futexcount, 1000 * N);
+    exit(1);
+  }
+  if(futexready != N + 1){
+    printf("%s: %d threads saw the broadcast, not %d\n", s, futexready - 1, N);
+    exit(1);
+  }
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2816,6 +4033,29 @@ struct test {
   {lazy_unmap, "lazy_unmap"},
   {lazy_copy, "lazy_copy"},
   {lazy_sbrk, "lazy_sbrk"},
+  {superpg, "superpg"},
+  {lazy_faultaround, "lazy_faultaround"},
+  {lazy_zeropage, "lazy_zeropage"},
+  {manyfiles, "manyfiles"},
+  {prezero, "prezero"},
+  {swaptest, "swaptest"},
+  {wsstest, "wsstest"},
+  {spawntest, "spawntest"},
+  {ksmtest, "ksmtest"},
+  {madvtest, "madvtest"},
+  {memfntest, "memfntest"},
+  {batchtest, "batchtest"},
+  {runqtest, "runqtest"},
+  {waitqtest, "waitqtest"},
+  {mlfqtest, "mlfqtest"},
+  {quantumtest, "quantumtest"},
+  {procinfotest, "procinfotest"},
+  {affinitytest, "affinitytest"},
+  {kalloccpu, "kalloccpu"},
+  {schedstattest, "schedstattest"},
+  {proctabletest, "proctabletest"},
+  {clonetest, "clonetest"},
+  {futextest, "futextest"},
   { 0, 0},
 };
 
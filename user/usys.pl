@@ -46,3 +46,17 @@ entry("hello");
 entry("procinfo");
 entry("checkpoint");
 entry("restore");
+entry("vmstat");
+entry("faultaround");
+entry("spawn");
+entry("ksm");
+entry("madvise");
+entry("setpriority");
+entry("quantum");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("schedstat");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
@@ -0,0 +1,51 @@
+// user/vmstat.c
+// Print the kernel's virtual memory counters.
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/stat.h"
+#include "kernel/vm.h"
+#include "kernel/vmstat.h"
+#include "user/user.h"
+
+int
+main(void)
+{
+  struct vmstat st;
+
+  if(vmstat(&st) < 0){
+    printf("vmstat: vmstat failed\n");
+    exit(1);
+  }
+
+  printf("lazy faults\t%ld\n", st.faults);
+  printf("fault-around\t%ld\n", st.faultaround);
+  printf("zero-page maps\t%ld\n", st.zerofaults);
+  printf("zero-page copies\t%ld\n", st.zerocopy);
+  printf("free pages\t%ld\n", st.freepages);
+  printf("slab pages\t%ld\n", st.slabpages);
+  printf("swap out\t%ld\n", st.swapout);
+  printf("swap in\t\t%ld\n", st.swapin);
+  printf("swap used\t%ld of %ld\n", st.swapused, st.swapslots);
+  printf("ksm merged\t%ld (zero %ld, copied on write %ld, scanned %ld)\n",
+         st.ksmmerged, st.ksmzero, st.ksmcow, st.ksmscanned);
+  printf("ksm pages\t%ld shared by %ld (saving %ld)\n",
+         st.ksmpages, st.ksmsharing, st.ksmsharing - st.ksmpages);
+  printf("madvise\t\tdontneed %ld, willneed %ld\n", st.dontneed, st.willneed);
+  printf("megapages\t%ld (split %ld)\n", st.megapages, st.megasplits);
+  printf("pre-zeroed\t%ld (hit %ld, miss %ld)\n", st.prezeroed, st.prezerohit, st.prezeromiss);
+  printf("free blocks\t");
+  for(int k = 0; k < KNORDER; k++)
+    printf(" %ld", st.freeblocks[k]);
+  printf("\n");
+
+  printf("cpu\talloc\tfree\trefill\tsteal\tbatch\n");
+  for(int i = 0; i < NCPU; i++){
+    struct kcpustat *c = &st.cpu[i];
+    if(c->nalloc == 0 && c->nfree == 0)
+      continue;
+    printf("%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", i, c->nalloc, c->nfree, c->nrefill,
+           c->nsteal, c->nbatch);
+  }
+
+  exit(0);
+}